@@ -1,6 +1,7 @@
 #include <gtk/gtk.h>
-#include "rkusb.h"
-#include "rkbin.h"
+#include "rkflash.h"
+
+#define RKFLASH_BLOCKSIZE   0x8000      /* bytes written at a time */
 
 static GtkWidget *win;
 
@@ -23,26 +24,27 @@ void append_text(GtkTextBuffer *data, char *buf) {
  };
 
 void erase_device(GtkWidget *widget, GtkTextBuffer *data) {
-    rkusb_device *di = NULL;
+    rkflash *di = NULL;
     char *str = malloc(256);
-    int size = 0xf424, offset=0, perc = 0;
-    GThread* thread;
+    uint8_t *buf = malloc(RKFLASH_BLOCKSIZE);
+    int size = 0xf424, offset=0, perc = 0, ret;
 
     while (g_main_context_pending(NULL)) g_main_context_iteration(NULL, FALSE);
 
-    if ( !(di = rkusb_connect_device(di)) )  {
-        append_text(data, "Unable to connect device\r\n");
+    if ((ret = rkflash_open(&di, NULL)))  {
+        snprintf(str, 256, "Unable to connect device: %s\r\n", rkflash_strerror(ret));
+        append_text(data, str);
+        free(str);
+        free(buf);
         return;
     }
 
-    if (di->mode != RKFT_USB_MODE_MASKROM && di->mode != RKFT_USB_MODE_LOADER) {
-        info("Something is wrong\r\n");
+    if (rkflash_mode(di) != RKFLASH_MODE_MASKROM && rkflash_mode(di) != RKFLASH_MODE_LOADER) {
         append_text(data, "Something is wrong\r\n");
-        return ;
     } else {
         int completed = 0;
         //thread = g_thread_new("erase_thread",erase_thread
-        memset(di->buf, 0xff, RKFT_BLOCKSIZE);
+        memset(buf, 0xff, RKFLASH_BLOCKSIZE);
         while (size > 0) {
             
             if (completed % (640 * 10) == 0) {
@@ -50,19 +52,21 @@ void erase_device(GtkWidget *widget, GtkTextBuffer *data) {
                 append_text(data, str);
                 perc += 10;
             }
-            infocr("erasing flash memory at offset 0x%08x", offset);
-            rkusb_send_cmd(di, RKFT_CMD_WRITELBA, offset, RKFT_OFF_INCR);
-            rkusb_send_buf(di,RKFT_BLOCKSIZE);
-            rkusb_recv_res(di);
-
-            offset += RKFT_OFF_INCR;
-            size   -= RKFT_OFF_INCR;
-            completed += RKFT_OFF_INCR;
+            if ((ret = rkflash_write(di, offset, RKFLASH_BLOCKSIZE >> 9, buf))) {
+                snprintf(str, 256, "Erase failed at 0x%08x: %s\r\n", offset, rkflash_strerror(ret));
+                append_text(data, str);
+                break;
+            }
+
+            offset += RKFLASH_BLOCKSIZE >> 9;
+            size   -= RKFLASH_BLOCKSIZE >> 9;
+            completed += RKFLASH_BLOCKSIZE >> 9;
         }
-        append_text(data, "Erase flash completed\r\n");
+        if (size <= 0) append_text(data, "Erase flash completed\r\n");
     }
     free(str);
-    rkusb_disconnect(di);
+    free(buf);
+    rkflash_close(di);
 }
 
 void reset_device(GtkWidget *widget, GtkTextBuffer *data) {
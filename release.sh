@@ -16,6 +16,7 @@ cp -a \
     rkflashtool.c \
     rkcrc.c \
     rkcrc.h \
+    rkcrclib.c \
     rkunpack.c \
     version.h \
     $SCRIPTS \
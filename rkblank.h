@@ -0,0 +1,51 @@
+#ifndef _RKBLANK_H_
+#define _RKBLANK_H_
+
+#include <stdint.h>
+#include <string.h>
+
+#define RKBLANK_DATA    -1
+#define RKBLANK_ZERO    0x00
+#define RKBLANK_FF      0xff
+
+/* 32 bytes at a time with GCC vector extensions (SSE2/NEON or plain words) */
+typedef uint64_t rkblank_vec __attribute__((vector_size(32)));
+
+/*
+ * Classifies a buffer as all 0x00 (RKBLANK_ZERO), all 0xff (RKBLANK_FF)
+ * or anything else (RKBLANK_DATA).  Scans 256 bytes between early exits,
+ * so data buffers are rejected almost immediately.
+ */
+static inline int rkblank(const uint8_t *buf, size_t len)
+{
+	rkblank_vec v, or = { 0 }, and = ~or;
+	uint64_t o = 0, a = ~0ull;
+	size_t i = 0;
+
+	for (; i + 256 <= len; i += 256) {
+		for (int j = 0; j < 256; j += sizeof(v)) {
+			memcpy(&v, buf + i + j, sizeof(v));
+			or |= v;
+			and &= v;
+		}
+		for (int j = 0; j < 4; j++) {
+			o |= or[j];
+			a &= and[j];
+		}
+		if (o && ~a)
+			return RKBLANK_DATA;
+	}
+
+	for (; i < len; i++) {
+		o |= buf[i];
+		a &= buf[i] | ~0xffull;
+	}
+
+	if (!o)
+		return RKBLANK_ZERO;
+	if (!~a)
+		return RKBLANK_FF;
+	return RKBLANK_DATA;
+}
+
+#endif /* !_RKBLANK_H_ */
@@ -24,6 +24,7 @@
  * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#define _GNU_SOURCE             /* copy_file_range */
 #include <sys/stat.h>
 #include <stdarg.h>
 #include <errno.h>
@@ -32,6 +33,8 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
 
 #include "rkcrc.h"
 #include "rkflashtool.h"
@@ -57,13 +60,65 @@ static void info_and_fatal(const int s, char *f, ...) {
 #define info(...)   info_and_fatal(0, __VA_ARGS__)
 #define fatal(...)  info_and_fatal(1, __VA_ARGS__)
 
+#define RKCRC_SLICE_MIN (4 << 20)  /* smallest share of the input per thread */
+#define RKCRC_THREADS   64
+#define RKCRC_BUFSIZE   (1 << 20)
+
+typedef struct {
+    pthread_t thread;
+    uint8_t *buf;
+    uint64_t size;
+    uint32_t crc;
+    int threaded;
+} rkcrc_slice;
+
+static void *crc_slice(void *arg) {
+    rkcrc_slice *sl = arg;
+    sl->crc = rkcrc32(0, sl->buf, sl->size);
+    return NULL;
+}
+
+static int ncpus(void) {
+#ifdef _SC_NPROCESSORS_ONLN
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n < 1 ? 1 : n > RKCRC_THREADS ? RKCRC_THREADS : n;
+#else
+    return 1;
+#endif
+}
+
+static void write_all(int fd, const uint8_t *buf, uint64_t size, const char *name) {
+    ssize_t nw;
+
+    for (; size; buf += nw, size -= nw)
+        if ((nw = write(fd, buf, size < 0x40000000 ? size : 0x40000000)) <= 0)
+            fatal("%s: write error\n", name);
+}
+
+/* copies the whole input: in the kernel where it can, else from the map */
+static void copy_data(int in, int out, const uint8_t *map, uint64_t size, const char *name) {
+#ifdef __linux__
+    ssize_t n;
+
+    while (size && (n = copy_file_range(in, NULL, out, NULL, size, 0)) > 0) {
+        map += n;
+        size -= n;
+    }
+#else
+    (void)in;
+#endif
+    write_all(out, map, size, name);
+}
+
 int main(int argc, char *argv[]) {
     struct stat st;
     ssize_t nr;
     uint32_t crc = 0;
-    uint8_t buf[512];
+    uint8_t buf[8], *map;
     char *progname = argv[0];
-    int ch, which = -1, in, out;
+    int ch, which = -1, in, out, i, n;
+    rkcrc_slice sl[RKCRC_THREADS];
+    uint64_t size, share;
 
     while ((ch = getopt(argc, argv, "kp")) != -1) {
         switch (ch) {
@@ -97,10 +152,40 @@ int main(int argc, char *argv[]) {
           fatal("%s: write error\n", argv[1]);
     }
 
-    while ((nr = read(in, buf, sizeof(buf))) > 0) {
-        crc = rkcrc32(crc, buf, nr);
-        if(write(out, buf, nr) != nr)
-          fatal("%s: write error\n", argv[1]);
+    size = st.st_size;
+    map = S_ISREG(st.st_mode) && size ? mmap(NULL, size, PROT_READ, MAP_SHARED, in, 0) : MAP_FAILED;
+    if (map != MAP_FAILED) {
+        /* the input is checksummed in slices on all cores while the
+         * output is written, and the slice CRCs are combined */
+        n = size / RKCRC_SLICE_MIN;
+        if (n > ncpus()) n = ncpus();
+        if (n < 1) n = 1;
+        share = size / n;
+        for (i = 0; i < n; i++) {
+            sl[i].buf = map + i * share;
+            sl[i].size = i < n - 1 ? share : size - i * share;
+            sl[i].threaded = i && !pthread_create(&sl[i].thread, NULL, crc_slice, &sl[i]);
+            if (i && !sl[i].threaded)
+                crc_slice(&sl[i]);
+        }
+        copy_data(in, out, map, size, argv[1]);
+        crc_slice(&sl[0]);
+        crc = sl[0].crc;
+        for (i = 1; i < n; i++) {
+            if (sl[i].threaded) pthread_join(sl[i].thread, NULL);
+            crc = rkcrc32_combine(crc, sl[i].crc, sl[i].size);
+        }
+        munmap(map, size);
+    } else {
+        if (!(map = malloc(RKCRC_BUFSIZE)))
+            fatal("out of memory\n");
+        while ((nr = read(in, map, RKCRC_BUFSIZE)) > 0) {
+            crc = rkcrc32(crc, map, nr);
+            write_all(out, map, nr, argv[1]);
+        }
+        if (nr < 0)
+            fatal("%s: %s\n", argv[0], strerror(errno));
+        free(map);
     }
 
     PUT32LE(buf, crc);
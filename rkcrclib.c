@@ -0,0 +1,519 @@
+/*-
+ * Copyright (c) 2010,2014 FUKAUMI Naoki.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * rkcrclib - the CRCs and the RC4 scrambling of librkflash, see rkcrc.h
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include "rkcrc.h"
+
+const uint16_t rkcrc16_table[256] = {
+	0x0000, 0x1021, 0x2042, 0x3063,
+	0x4084, 0x50a5, 0x60c6, 0x70e7,
+	0x8108, 0x9129, 0xa14a, 0xb16b,
+	0xc18c, 0xd1ad, 0xe1ce, 0xf1ef,
+	0x1231, 0x0210, 0x3273, 0x2252,
+	0x52b5, 0x4294, 0x72f7, 0x62d6,
+	0x9339, 0x8318, 0xb37b, 0xa35a,
+	0xd3bd, 0xc39c, 0xf3ff, 0xe3de,
+	0x2462, 0x3443, 0x0420, 0x1401,
+	0x64e6, 0x74c7, 0x44a4, 0x5485,
+	0xa56a, 0xb54b, 0x8528, 0x9509,
+	0xe5ee, 0xf5cf, 0xc5ac, 0xd58d,
+	0x3653, 0x2672, 0x1611, 0x0630,
+	0x76d7, 0x66f6, 0x5695, 0x46b4,
+	0xb75b, 0xa77a, 0x9719, 0x8738,
+	0xf7df, 0xe7fe, 0xd79d, 0xc7bc,
+	0x48c4, 0x58e5, 0x6886, 0x78a7,
+	0x0840, 0x1861, 0x2802, 0x3823,
+	0xc9cc, 0xd9ed, 0xe98e, 0xf9af,
+	0x8948, 0x9969, 0xa90a, 0xb92b,
+	0x5af5, 0x4ad4, 0x7ab7, 0x6a96,
+	0x1a71, 0x0a50, 0x3a33, 0x2a12,
+	0xdbfd, 0xcbdc, 0xfbbf, 0xeb9e,
+	0x9b79, 0x8b58, 0xbb3b, 0xab1a,
+	0x6ca6, 0x7c87, 0x4ce4, 0x5cc5,
+	0x2c22, 0x3c03, 0x0c60, 0x1c41,
+	0xedae, 0xfd8f, 0xcdec, 0xddcd,
+	0xad2a, 0xbd0b, 0x8d68, 0x9d49,
+	0x7e97, 0x6eb6, 0x5ed5, 0x4ef4,
+	0x3e13, 0x2e32, 0x1e51, 0x0e70,
+	0xff9f, 0xefbe, 0xdfdd, 0xcffc,
+	0xbf1b, 0xaf3a, 0x9f59, 0x8f78,
+	0x9188, 0x81a9, 0xb1ca, 0xa1eb,
+	0xd10c, 0xc12d, 0xf14e, 0xe16f,
+	0x1080, 0x00a1, 0x30c2, 0x20e3,
+	0x5004, 0x4025, 0x7046, 0x6067,
+	0x83b9, 0x9398, 0xa3fb, 0xb3da,
+	0xc33d, 0xd31c, 0xe37f, 0xf35e,
+	0x02b1, 0x1290, 0x22f3, 0x32d2,
+	0x4235, 0x5214, 0x6277, 0x7256,
+	0xb5ea, 0xa5cb, 0x95a8, 0x8589,
+	0xf56e, 0xe54f, 0xd52c, 0xc50d,
+	0x34e2, 0x24c3, 0x14a0, 0x0481,
+	0x7466, 0x6447, 0x5424, 0x4405,
+	0xa7db, 0xb7fa, 0x8799, 0x97b8,
+	0xe75f, 0xf77e, 0xc71d, 0xd73c,
+	0x26d3, 0x36f2, 0x0691, 0x16b0,
+	0x6657, 0x7676, 0x4615, 0x5634,
+	0xd94c, 0xc96d, 0xf90e, 0xe92f,
+	0x99c8, 0x89e9, 0xb98a, 0xa9ab,
+	0x5844, 0x4865, 0x7806, 0x6827,
+	0x18c0, 0x08e1, 0x3882, 0x28a3,
+	0xcb7d, 0xdb5c, 0xeb3f, 0xfb1e,
+	0x8bf9, 0x9bd8, 0xabbb, 0xbb9a,
+	0x4a75, 0x5a54, 0x6a37, 0x7a16,
+	0x0af1, 0x1ad0, 0x2ab3, 0x3a92,
+	0xfd2e, 0xed0f, 0xdd6c, 0xcd4d,
+	0xbdaa, 0xad8b, 0x9de8, 0x8dc9,
+	0x7c26, 0x6c07, 0x5c64, 0x4c45,
+	0x3ca2, 0x2c83, 0x1ce0, 0x0cc1,
+	0xef1f, 0xff3e, 0xcf5d, 0xdf7c,
+	0xaf9b, 0xbfba, 0x8fd9, 0x9ff8,
+	0x6e17, 0x7e36, 0x4e55, 0x5e74,
+	0x2e93, 0x3eb2, 0x0ed1, 0x1ef0,
+};
+
+const uint32_t rkcrc32_table[256] = {
+	0x00000000, 0x04c10db7, 0x09821b6e, 0x0d4316d9,
+	0x130436dc, 0x17c53b6b, 0x1a862db2, 0x1e472005,
+	0x26086db8, 0x22c9600f, 0x2f8a76d6, 0x2b4b7b61,
+	0x350c5b64, 0x31cd56d3, 0x3c8e400a, 0x384f4dbd,
+	0x4c10db70, 0x48d1d6c7, 0x4592c01e, 0x4153cda9,
+	0x5f14edac, 0x5bd5e01b, 0x5696f6c2, 0x5257fb75,
+	0x6a18b6c8, 0x6ed9bb7f, 0x639aada6, 0x675ba011,
+	0x791c8014, 0x7ddd8da3, 0x709e9b7a, 0x745f96cd,
+	0x9821b6e0, 0x9ce0bb57, 0x91a3ad8e, 0x9562a039,
+	0x8b25803c, 0x8fe48d8b, 0x82a79b52, 0x866696e5,
+	0xbe29db58, 0xbae8d6ef, 0xb7abc036, 0xb36acd81,
+	0xad2ded84, 0xa9ece033, 0xa4aff6ea, 0xa06efb5d,
+	0xd4316d90, 0xd0f06027, 0xddb376fe, 0xd9727b49,
+	0xc7355b4c, 0xc3f456fb, 0xceb74022, 0xca764d95,
+	0xf2390028, 0xf6f80d9f, 0xfbbb1b46, 0xff7a16f1,
+	0xe13d36f4, 0xe5fc3b43, 0xe8bf2d9a, 0xec7e202d,
+	0x34826077, 0x30436dc0, 0x3d007b19, 0x39c176ae,
+	0x278656ab, 0x23475b1c, 0x2e044dc5, 0x2ac54072,
+	0x128a0dcf, 0x164b0078, 0x1b0816a1, 0x1fc91b16,
+	0x018e3b13, 0x054f36a4, 0x080c207d, 0x0ccd2dca,
+	0x7892bb07, 0x7c53b6b0, 0x7110a069, 0x75d1adde,
+	0x6b968ddb, 0x6f57806c, 0x621496b5, 0x66d59b02,
+	0x5e9ad6bf, 0x5a5bdb08, 0x5718cdd1, 0x53d9c066,
+	0x4d9ee063, 0x495fedd4, 0x441cfb0d, 0x40ddf6ba,
+	0xaca3d697, 0xa862db20, 0xa521cdf9, 0xa1e0c04e,
+	0xbfa7e04b, 0xbb66edfc, 0xb625fb25, 0xb2e4f692,
+	0x8aabbb2f, 0x8e6ab698, 0x8329a041, 0x87e8adf6,
+	0x99af8df3, 0x9d6e8044, 0x902d969d, 0x94ec9b2a,
+	0xe0b30de7, 0xe4720050, 0xe9311689, 0xedf01b3e,
+	0xf3b73b3b, 0xf776368c, 0xfa352055, 0xfef42de2,
+	0xc6bb605f, 0xc27a6de8, 0xcf397b31, 0xcbf87686,
+	0xd5bf5683, 0xd17e5b34, 0xdc3d4ded, 0xd8fc405a,
+	0x6904c0ee, 0x6dc5cd59, 0x6086db80, 0x6447d637,
+	0x7a00f632, 0x7ec1fb85, 0x7382ed5c, 0x7743e0eb,
+	0x4f0cad56, 0x4bcda0e1, 0x468eb638, 0x424fbb8f,
+	0x5c089b8a, 0x58c9963d, 0x558a80e4, 0x514b8d53,
+	0x25141b9e, 0x21d51629, 0x2c9600f0, 0x28570d47,
+	0x36102d42, 0x32d120f5, 0x3f92362c, 0x3b533b9b,
+	0x031c7626, 0x07dd7b91, 0x0a9e6d48, 0x0e5f60ff,
+	0x101840fa, 0x14d94d4d, 0x199a5b94, 0x1d5b5623,
+	0xf125760e, 0xf5e47bb9, 0xf8a76d60, 0xfc6660d7,
+	0xe22140d2, 0xe6e04d65, 0xeba35bbc, 0xef62560b,
+	0xd72d1bb6, 0xd3ec1601, 0xdeaf00d8, 0xda6e0d6f,
+	0xc4292d6a, 0xc0e820dd, 0xcdab3604, 0xc96a3bb3,
+	0xbd35ad7e, 0xb9f4a0c9, 0xb4b7b610, 0xb076bba7,
+	0xae319ba2, 0xaaf09615, 0xa7b380cc, 0xa3728d7b,
+	0x9b3dc0c6, 0x9ffccd71, 0x92bfdba8, 0x967ed61f,
+	0x8839f61a, 0x8cf8fbad, 0x81bbed74, 0x857ae0c3,
+	0x5d86a099, 0x5947ad2e, 0x5404bbf7, 0x50c5b640,
+	0x4e829645, 0x4a439bf2, 0x47008d2b, 0x43c1809c,
+	0x7b8ecd21, 0x7f4fc096, 0x720cd64f, 0x76cddbf8,
+	0x688afbfd, 0x6c4bf64a, 0x6108e093, 0x65c9ed24,
+	0x11967be9, 0x1557765e, 0x18146087, 0x1cd56d30,
+	0x02924d35, 0x06534082, 0x0b10565b, 0x0fd15bec,
+	0x379e1651, 0x335f1be6, 0x3e1c0d3f, 0x3add0088,
+	0x249a208d, 0x205b2d3a, 0x2d183be3, 0x29d93654,
+	0xc5a71679, 0xc1661bce, 0xcc250d17, 0xc8e400a0,
+	0xd6a320a5, 0xd2622d12, 0xdf213bcb, 0xdbe0367c,
+	0xe3af7bc1, 0xe76e7676, 0xea2d60af, 0xeeec6d18,
+	0xf0ab4d1d, 0xf46a40aa, 0xf9295673, 0xfde85bc4,
+	0x89b7cd09, 0x8d76c0be, 0x8035d667, 0x84f4dbd0,
+	0x9ab3fbd5, 0x9e72f662, 0x9331e0bb, 0x97f0ed0c,
+	0xafbfa0b1, 0xab7ead06, 0xa63dbbdf, 0xa2fcb668,
+	0xbcbb966d, 0xb87a9bda, 0xb5398d03, 0xb1f880b4,
+};
+
+/*
+ * Faster kernels, bit-identical to the byte-at-a-time loops:
+ *
+ *  - slice-by-8: one lookup per byte in eight tables, the ones for 1..7
+ *    trailing zero bytes derived from rkcrc16_table/rkcrc32_table;
+ *  - carry-less multiply folding (PCLMULQDQ on x86, PMULL on ARMv8):
+ *    four 128-bit lanes are carried forward 512 bits at a time with
+ *    x^n mod P constants, folded into one, and the 16 bytes that stand
+ *    for the whole prefix are finished with the tables.
+ *
+ * Both CRCs are MSB-first with no reflection or final xor, so the running
+ * CRC simply goes into the top bits of the first block.  The tables and
+ * constants are made on first use, and the folding kernel is used from
+ * then on if the CPU has it.
+ */
+
+#define RKCRC_FOLD_MIN	256	/* shorter buffers are not worth folding */
+
+static uint32_t rkcrc32_slice[8][256];
+static uint16_t rkcrc16_slice[8][256];
+/* x^n and x^(n+64) mod P for n = 512, 384, 256 and 128 */
+static uint64_t rkcrc32_k[8], rkcrc16_k[8];
+static int rkcrc_has_fold;		/* the CPU can fold */
+static pthread_once_t rkcrc_once = PTHREAD_ONCE_INIT;
+int rkcrc_clmul = 1;
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+
+#define RKCRC_TARGET	__attribute__((target("pclmul,ssse3")))
+typedef __m128i rkcrc_vec;
+
+/* 16 bytes, the first one in the top bits */
+static inline RKCRC_TARGET rkcrc_vec rkcrc_load(const uint8_t *p)
+{
+	return _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)p),
+		_mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15));
+}
+
+static inline RKCRC_TARGET void rkcrc_store(uint8_t *p, rkcrc_vec x)
+{
+	_mm_storeu_si128((__m128i *)p, _mm_shuffle_epi8(x,
+		_mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15)));
+}
+
+static inline RKCRC_TARGET rkcrc_vec rkcrc_top(rkcrc_vec x, uint64_t top)
+{
+	return _mm_xor_si128(x, _mm_set_epi64x(top, 0));
+}
+
+/* x * x^n + d, with k = { x^n, x^(n+64) } mod P */
+static inline RKCRC_TARGET rkcrc_vec rkcrc_fold1(rkcrc_vec x, const uint64_t *k, rkcrc_vec d)
+{
+	rkcrc_vec kv = _mm_loadu_si128((const __m128i *)k);
+
+	return _mm_xor_si128(d, _mm_xor_si128(_mm_clmulepi64_si128(x, kv, 0x00),
+					      _mm_clmulepi64_si128(x, kv, 0x11)));
+}
+
+static inline int rkcrc_has_clmul(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("ssse3");
+}
+
+#elif defined(__GNUC__) && defined(__aarch64__) && defined(__linux__)
+#include <arm_neon.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+
+#define RKCRC_TARGET	__attribute__((target("+crypto")))
+typedef uint64x2_t rkcrc_vec;
+
+static inline RKCRC_TARGET uint8x16_t rkcrc_swap(uint8x16_t v)
+{
+	v = vrev64q_u8(v);
+	return vextq_u8(v, v, 8);
+}
+
+static inline RKCRC_TARGET rkcrc_vec rkcrc_load(const uint8_t *p)
+{
+	return vreinterpretq_u64_u8(rkcrc_swap(vld1q_u8(p)));
+}
+
+static inline RKCRC_TARGET void rkcrc_store(uint8_t *p, rkcrc_vec x)
+{
+	vst1q_u8(p, rkcrc_swap(vreinterpretq_u8_u64(x)));
+}
+
+static inline RKCRC_TARGET rkcrc_vec rkcrc_top(rkcrc_vec x, uint64_t top)
+{
+	return veorq_u64(x, vcombine_u64(vcreate_u64(0), vcreate_u64(top)));
+}
+
+static inline RKCRC_TARGET rkcrc_vec rkcrc_fold1(rkcrc_vec x, const uint64_t *k, rkcrc_vec d)
+{
+	rkcrc_vec lo = vreinterpretq_u64_p128(vmull_p64(vgetq_lane_u64(x, 0), k[0]));
+	rkcrc_vec hi = vreinterpretq_u64_p128(vmull_p64(vgetq_lane_u64(x, 1), k[1]));
+
+	return veorq_u64(d, veorq_u64(lo, hi));
+}
+
+static inline int rkcrc_has_clmul(void)
+{
+	return !!(getauxval(AT_HWCAP) & HWCAP_PMULL);
+}
+#endif
+
+#ifdef RKCRC_TARGET
+/*
+ * Folds whole 16-byte blocks of buf (at least four) into out, 16 bytes
+ * whose CRC from 0 equals the CRC of those blocks from crc, a width-bit
+ * value.  Returns the number of bytes consumed.
+ */
+static RKCRC_TARGET uint64_t rkcrc_fold(uint32_t crc, int width, const uint64_t *k,
+					const uint8_t *buf, uint64_t size, uint8_t *out)
+{
+	rkcrc_vec x0 = rkcrc_load(buf), x1 = rkcrc_load(buf + 16),
+		  x2 = rkcrc_load(buf + 32), x3 = rkcrc_load(buf + 48);
+	uint64_t n;
+
+	x0 = rkcrc_top(x0, (uint64_t)crc << (64 - width));
+	for (n = 64; n + 64 <= size; n += 64) {
+		x0 = rkcrc_fold1(x0, k, rkcrc_load(buf + n));
+		x1 = rkcrc_fold1(x1, k, rkcrc_load(buf + n + 16));
+		x2 = rkcrc_fold1(x2, k, rkcrc_load(buf + n + 32));
+		x3 = rkcrc_fold1(x3, k, rkcrc_load(buf + n + 48));
+	}
+	x3 = rkcrc_fold1(x0, k + 2, rkcrc_fold1(x1, k + 4, rkcrc_fold1(x2, k + 6, x3)));
+	for (; n + 16 <= size; n += 16)
+		x3 = rkcrc_fold1(x3, k + 6, rkcrc_load(buf + n));
+	rkcrc_store(out, x3);
+	return n;
+}
+#endif
+
+/* x^n mod P for a width-bit polynomial */
+static uint32_t rkcrc_xpow(unsigned n, uint32_t poly, int width)
+{
+	uint32_t top = 1u << (width - 1), v = 1;
+
+	while (n--)
+		v = (v & top ? (v << 1) ^ poly : v << 1) & (top | (top - 1));
+	return v;
+}
+
+static void rkcrc_init(void)
+{
+	uint32_t c;
+	int i, k;
+
+	for (i = 0; i < 256; i++) {
+		rkcrc32_slice[0][i] = rkcrc32_table[i];
+		rkcrc16_slice[0][i] = rkcrc16_table[i];
+	}
+	for (k = 1; k < 8; k++) {
+		for (i = 0; i < 256; i++) {
+			c = rkcrc32_slice[k - 1][i];
+			rkcrc32_slice[k][i] = (c << 8) ^ rkcrc32_table[c >> 24];
+			c = rkcrc16_slice[k - 1][i];
+			rkcrc16_slice[k][i] = (c << 8) ^ rkcrc16_table[c >> 8];
+		}
+	}
+	/* the polynomials are the table entries for 1 */
+	for (i = 0; i < 4; i++) {
+		rkcrc32_k[2 * i] = rkcrc_xpow(512 - 128 * i, rkcrc32_table[1], 32);
+		rkcrc32_k[2 * i + 1] = rkcrc_xpow(576 - 128 * i, rkcrc32_table[1], 32);
+		rkcrc16_k[2 * i] = rkcrc_xpow(512 - 128 * i, rkcrc16_table[1], 16);
+		rkcrc16_k[2 * i + 1] = rkcrc_xpow(576 - 128 * i, rkcrc16_table[1], 16);
+	}
+#ifdef RKCRC_TARGET
+	rkcrc_has_fold = rkcrc_has_clmul();
+#endif
+}
+
+static inline uint16_t rkcrc16_sliced(uint16_t crc, const uint8_t *buf, uint64_t size)
+{
+	uint16_t (*t)[256] = rkcrc16_slice;
+
+	for (; size >= 8; buf += 8, size -= 8)
+		crc = t[7][buf[0] ^ crc >> 8] ^ t[6][buf[1] ^ (crc & 0xff)] ^
+		      t[5][buf[2]] ^ t[4][buf[3]] ^ t[3][buf[4]] ^ t[2][buf[5]] ^
+		      t[1][buf[6]] ^ t[0][buf[7]];
+	while (size-- > 0)
+		crc = (crc << 8) ^ rkcrc16_table[(crc >> 8) ^ *buf++];
+
+	return crc;
+}
+
+static inline uint32_t rkcrc32_sliced(uint32_t crc, const uint8_t *buf, uint64_t size)
+{
+	uint32_t (*t)[256] = rkcrc32_slice;
+	uint32_t hi, lo;
+
+	for (; size >= 8; buf += 8, size -= 8) {
+		hi = crc ^ ((uint32_t)buf[0] << 24 | buf[1] << 16 | buf[2] << 8 | buf[3]);
+		lo = (uint32_t)buf[4] << 24 | buf[5] << 16 | buf[6] << 8 | buf[7];
+		crc = t[7][hi >> 24] ^ t[6][hi >> 16 & 0xff] ^ t[5][hi >> 8 & 0xff] ^ t[4][hi & 0xff] ^
+		      t[3][lo >> 24] ^ t[2][lo >> 16 & 0xff] ^ t[1][lo >> 8 & 0xff] ^ t[0][lo & 0xff];
+	}
+	while (size-- > 0)
+		crc = (crc << 8) ^ rkcrc32_table[(crc >> 24) ^ *buf++];
+
+	return crc;
+}
+
+uint16_t rkcrc16(uint16_t crc, uint8_t *buf, uint64_t size)
+{
+#ifdef RKCRC_TARGET
+	uint8_t r[16];
+	uint64_t n;
+#endif
+
+	pthread_once(&rkcrc_once, rkcrc_init);
+#ifdef RKCRC_TARGET
+	if (rkcrc_clmul && rkcrc_has_fold && size >= RKCRC_FOLD_MIN) {
+		n = rkcrc_fold(crc, 16, rkcrc16_k, buf, size, r);
+		return rkcrc16_sliced(rkcrc16_sliced(0, r, 16), buf + n, size - n);
+	}
+#endif
+	return rkcrc16_sliced(crc, buf, size);
+}
+
+uint32_t rkcrc32(uint32_t crc, uint8_t *buf, uint64_t size)
+{
+#ifdef RKCRC_TARGET
+	uint8_t r[16];
+	uint64_t n;
+#endif
+
+	pthread_once(&rkcrc_once, rkcrc_init);
+#ifdef RKCRC_TARGET
+	if (rkcrc_clmul && rkcrc_has_fold && size >= RKCRC_FOLD_MIN) {
+		n = rkcrc_fold(crc, 32, rkcrc32_k, buf, size, r);
+		return rkcrc32_sliced(rkcrc32_sliced(0, r, 16), buf + n, size - n);
+	}
+#endif
+	return rkcrc32_sliced(crc, buf, size);
+}
+
+/* a * b mod P for the CRC32 polynomial */
+static uint32_t rkcrc32_mulmod(uint32_t a, uint32_t b)
+{
+	uint32_t r = 0;
+	int i;
+
+	for (i = 31; i >= 0; i--) {
+		r = r & 0x80000000 ? (r << 1) ^ rkcrc32_table[1] : r << 1;
+		if (a >> i & 1)
+			r ^= b;
+	}
+	return r;
+}
+
+/*
+ * CRC32 of A followed by B from the CRCs of both (each from 0) and the
+ * length of B: running n more bytes through the CRC multiplies the
+ * register by x^8n mod P, and the rest is linear.
+ */
+uint32_t rkcrc32_combine(uint32_t crc1, uint32_t crc2, uint64_t len2)
+{
+	uint32_t x8n = 1, sq = 0x100;	/* x^0, x^8 */
+
+	for (; len2; len2 >>= 1) {
+		if (len2 & 1)
+			x8n = rkcrc32_mulmod(x8n, sq);
+		sq = rkcrc32_mulmod(sq, sq);
+	}
+	return rkcrc32_mulmod(crc1, x8n) ^ crc2;
+}
+
+/*
+ * The RC4 key is fixed and every call starts the stream afresh, so the
+ * first RKRC4_STREAM bytes of keystream are made on first use and
+ * xored in 32 bytes at a time.  Longer buffers go on from the state saved
+ * at the end of the cached stream.
+ */
+#define RKRC4_STREAM	0x10000
+
+static unsigned char rkrc4_stream[RKRC4_STREAM];
+static unsigned char rkrc4_S[256], rkrc4_i, rkrc4_j;   /* state after the cached stream */
+static pthread_once_t rkrc4_once = PTHREAD_ONCE_INIT;
+
+typedef unsigned char rkrc4_vec __attribute__((vector_size(32)));
+
+static void rkrc4_init(void)
+{
+    unsigned char key[16]={124,78,3,4,85,5,9,7,45,44,123,56,23,13,23,17};
+    unsigned char *S = rkrc4_S, temp, i, j;
+    unsigned x;
+
+    for(x=0; x<256; x++)
+        S[x] = (unsigned char)x;
+
+    j = 0;
+    for(x=0; x<256; x++){
+        j = j + S[x] + key[x & 0x0f];
+        temp = S[x];
+        S[x] = S[j];
+        S[j] = temp;
+    }
+
+    i = j = 0;
+    for(x=0; x<RKRC4_STREAM; x++){
+        i++;
+        j += S[i];
+        temp = S[i];
+        S[i] = S[j];
+        S[j] = temp;
+        rkrc4_stream[x] = S[(unsigned char)(S[i] + S[j])];
+    }
+    rkrc4_i = i;
+    rkrc4_j = j;
+}
+
+void rkrc4(unsigned char* buf, size_t len)
+{
+    unsigned char S[256], temp, i, j;
+    rkrc4_vec a, k;
+    size_t x, n = len < RKRC4_STREAM ? len : RKRC4_STREAM;
+
+    pthread_once(&rkrc4_once, rkrc4_init);
+
+    for(x=0; x+sizeof(a)<=n; x+=sizeof(a)){
+        memcpy(&a, buf + x, sizeof(a));
+        memcpy(&k, rkrc4_stream + x, sizeof(k));
+        a ^= k;
+        memcpy(buf + x, &a, sizeof(a));
+    }
+    if (x < n) {
+        memcpy(&a, buf + x, n - x);
+        memcpy(&k, rkrc4_stream + x, sizeof(k));
+        a ^= k;
+        memcpy(buf + x, &a, n - x);
+        x = n;
+    }
+    if (x == len)
+        return;
+
+    memcpy(S, rkrc4_S, sizeof(S));
+    i = rkrc4_i;
+    j = rkrc4_j;
+    for(; x<len; x++){
+        i++;
+        j += S[i];
+        temp = S[i];
+        S[i] = S[j];
+        S[j] = temp;
+        buf[x] ^= S[(unsigned char)(S[i] + S[j])];
+    }
+}
@@ -0,0 +1,239 @@
+/*
+ * rkflash - the librkflash interface, see rkflash.h
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#if RKUSB_MOCK
+#include "rkmock.h"
+#else
+#include <libusb.h>
+#endif
+#include "rkusb.h"
+#include "rkpipe.h"
+#include "rkflash.h"
+
+#define RKFLASH_DEPTH   4               /* transfers in flight by default */
+
+struct rkflash {
+    rkusb_device *usb;
+    int depth;
+};
+
+/* a transfer to or from the caller's buffer */
+typedef struct {
+    uint8_t *buf;
+    const uint8_t *src;
+    uint32_t start, offset, end, incr;
+} rkflash_job;
+
+static int rkflash_error(int r) {
+    switch (r) {
+    case 0:                         return RKFLASH_OK;
+    case LIBUSB_ERROR_NO_DEVICE:
+    case LIBUSB_ERROR_NOT_FOUND:    return RKFLASH_ERROR_NO_DEVICE;
+    case LIBUSB_ERROR_ACCESS:
+    case LIBUSB_ERROR_BUSY:         return RKFLASH_ERROR_ACCESS;
+    case LIBUSB_ERROR_TIMEOUT:      return RKFLASH_ERROR_TIMEOUT;
+    case LIBUSB_ERROR_NO_MEM:       return RKFLASH_ERROR_NO_MEM;
+    case LIBUSB_ERROR_INVALID_PARAM: return RKFLASH_ERROR_INVALID;
+    default:                        return RKFLASH_ERROR_IO;
+    }
+}
+
+/* a command whose reply of up to len bytes goes to buf; the rest is zeroed */
+static int rkflash_query(rkflash *dev, uint32_t command, uint8_t *buf, int len) {
+    rkusb_device *usb = dev->usb;
+    uint8_t reply[512];
+    int r;
+
+    memset(reply, 0, sizeof(reply));
+    if ((r = rkusb_send_cmd(usb, command, 0, 0))) {
+        rkusb_sync_done(usb);
+        return rkflash_error(r);
+    }
+    /* the length of the reply varies with the loader, only failures count */
+    if ((r = rkusb_sync_xfer(usb, 1|LIBUSB_ENDPOINT_IN, reply, sizeof(reply), 1)) && usb->sync.error) {
+        rkusb_sync_done(usb);
+        return rkflash_error(r);
+    }
+    if ((r = rkusb_recv_res(usb)))
+        return rkflash_error(r);
+    if (rkusb_res_status(usb))
+        return RKFLASH_ERROR_REJECTED;
+    memcpy(buf, reply, len);
+    return RKFLASH_OK;
+}
+
+int rkflash_list(char (*paths)[RKFLASH_PATH_MAX], int max, uint16_t mode) {
+    int n = rkusb_list_devices(paths, max, mode);
+
+    return n < 0 ? RKFLASH_ERROR_IO : n;
+}
+
+int rkflash_open(rkflash **dev, const char *path) {
+    rkflash *d;
+    int r;
+
+    *dev = NULL;
+    if (!(d = calloc(1, sizeof(rkflash))))
+        return RKFLASH_ERROR_NO_MEM;
+    if ((r = rkusb_open_path(&d->usb, path))) {
+        free(d);
+        return rkflash_error(r);
+    }
+    d->depth = RKFLASH_DEPTH;
+    *dev = d;
+    return RKFLASH_OK;
+}
+
+void rkflash_close(rkflash *dev) {
+    if (!dev) return;
+    rkusb_disconnect(dev->usb);
+    free(dev);
+}
+
+const char *rkflash_path(const rkflash *dev) { return dev->usb->path; }
+const char *rkflash_soc(const rkflash *dev) { return dev->usb->soc; }
+uint16_t rkflash_pid(const rkflash *dev) { return dev->usb->pid; }
+uint16_t rkflash_mode(const rkflash *dev) { return dev->usb->mode; }
+
+int rkflash_set_transfer_size(rkflash *dev, uint32_t size) {
+    return rkusb_set_blocksize(dev->usb, size) ? RKFLASH_ERROR_INVALID : RKFLASH_OK;
+}
+
+int rkflash_set_queue_depth(rkflash *dev, int depth) {
+    if (depth < 1 || depth > RKFT_QUEUE_MAX)
+        return RKFLASH_ERROR_INVALID;
+    dev->depth = depth;
+    return RKFLASH_OK;
+}
+
+int rkflash_wait_ready(rkflash *dev, int timeout) {
+    return rkusb_wait_ready(dev->usb, timeout) ? RKFLASH_ERROR_TIMEOUT : RKFLASH_OK;
+}
+
+int rkflash_flash_id(rkflash *dev, uint8_t id[5]) {
+    return rkflash_query(dev, RKFT_CMD_READFLASHID, id, 5);
+}
+
+int rkflash_flash_info(rkflash *dev, rkflash_info *info) {
+    uint8_t b[11];
+    int r;
+
+    if ((r = rkflash_query(dev, RKFT_CMD_READFLASHINFO, b, sizeof(b))))
+        return r;
+    info->flash_size = b[0] | b[1] << 8 | b[2] << 16 | (uint32_t)b[3] << 24;
+    info->block_size = b[4] | b[5] << 8;
+    info->page_size = b[6];
+    info->ecc_bits = b[7];
+    info->access_time = b[8];
+    info->manufacturer_id = b[9];
+    info->chip_select = b[10];
+    return RKFLASH_OK;
+}
+
+int rkflash_chip_info(rkflash *dev, uint8_t info[16]) {
+    return rkflash_query(dev, RKFT_CMD_READCHIPINFO, info, 16);
+}
+
+static int rkflash_next(rkflash_job *job, rkusb_slot *slot, uint32_t command) {
+    uint32_t n = job->end - job->offset;
+
+    if (!n) return 0;
+    if (n > job->incr) n = job->incr;
+    rkusb_slot_cmd(slot, command, job->offset, n);
+    if (job->src)
+        memcpy(slot->buf, job->src + (size_t)(job->offset - job->start) * 512, n * 512);
+    job->offset += n;
+    return 1;
+}
+
+static int rkflash_read_next(void *ctx, rkusb_slot *slot) {
+    return rkflash_next(ctx, slot, RKFT_CMD_READLBA);
+}
+
+static int rkflash_write_next(void *ctx, rkusb_slot *slot) {
+    return rkflash_next(ctx, slot, RKFT_CMD_WRITELBA);
+}
+
+/* failed slots stop the pipe with what went wrong */
+static int rkflash_done(void *ctx, rkusb_slot *slot) {
+    rkflash_job *job = ctx;
+
+    if (slot->error)
+        return slot->error > 0 ? RKFLASH_ERROR_REJECTED : RKFLASH_ERROR_IO;
+    if (job->buf)
+        memcpy(job->buf + (size_t)(slot->offset - job->start) * 512, slot->buf, slot->length);
+    return 1;
+}
+
+static int rkflash_run(rkflash *dev, rkusb_stage produce, rkflash_job *job) {
+    int r;
+
+    job->offset = job->start;
+    job->incr = dev->usb->blocksize >> 9;
+    r = rkusb_pipe_exec(dev->usb, dev->depth, produce, rkflash_done, job);
+    if (r == LIBUSB_ERROR_NO_MEM)
+        return RKFLASH_ERROR_NO_MEM;
+    /* a transfer the pipe could not even submit */
+    return r < 0 && r != RKFLASH_ERROR_REJECTED ? RKFLASH_ERROR_IO : r;
+}
+
+int rkflash_read(rkflash *dev, uint32_t offset, uint32_t nsectors, void *buf) {
+    rkflash_job job = { buf, NULL, offset, offset, offset + nsectors, 0 };
+
+    return rkflash_run(dev, rkflash_read_next, &job);
+}
+
+int rkflash_write(rkflash *dev, uint32_t offset, uint32_t nsectors, const void *buf) {
+    rkflash_job job = { NULL, buf, offset, offset, offset + nsectors, 0 };
+
+    return rkflash_run(dev, rkflash_write_next, &job);
+}
+
+int rkflash_erase(rkflash *dev, uint32_t offset, uint32_t nsectors) {
+    uint32_t n;
+    int r;
+
+    while (nsectors) {
+        n = nsectors > RKFT_ERASE_INCR ? RKFT_ERASE_INCR : nsectors;
+        if ((r = rkusb_send_cmd(dev->usb, RKFT_CMD_ERASE_LBA, offset, n)) ||
+            (r = rkusb_recv_res(dev->usb))) {
+            rkusb_sync_done(dev->usb);
+            return rkflash_error(r);
+        }
+        if (rkusb_res_status(dev->usb))
+            return RKFLASH_ERROR_REJECTED;
+        offset += n;
+        nsectors -= n;
+    }
+    return RKFLASH_OK;
+}
+
+int rkflash_reset(rkflash *dev, uint8_t flag) {
+    return rkflash_error(rkusb_send_reset(dev->usb, flag));
+}
+
+size_t rkflash_vendor_code_size(size_t size) {
+    return rkusb_vendor_code_size(size);
+}
+
+size_t rkflash_vendor_code(uint8_t *out, const uint8_t *bin, size_t size) {
+    return rkusb_prepare_vendor_code(out, bin, size);
+}
+
+int rkflash_send_vendor_code(rkflash *dev, const uint8_t *code, size_t size, int index) {
+    return rkflash_error(rkusb_send_vendor_code(dev->usb, code, size, index));
+}
+
+const char *rkflash_strerror(int error) {
+    static const char *const errors[] = {
+        "success", "transfer failed", "rejected by the device", "no such device",
+        "access denied or device busy", "invalid argument", "out of memory", "timed out",
+    };
+
+    if (error > 0 || -error >= (int)(sizeof(errors) / sizeof(errors[0])))
+        return "unknown error";
+    return errors[-error];
+}
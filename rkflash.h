@@ -0,0 +1,101 @@
+#ifndef _RKFLASH_H_
+#define _RKFLASH_H_
+
+/*
+ * librkflash - RockUSB access for programs other than rkflashtool
+ *
+ * An rkflash is one open device with a libusb context of its own, so any
+ * number of them can be driven from separate threads of one process; a
+ * single rkflash must only be used by one thread at a time.  The library
+ * never prints or exits: every call returns RKFLASH_OK or one of the
+ * negative RKFLASH_ERROR_* codes, and data goes to and from buffers the
+ * caller owns.
+ *
+ *   cc -o tool tool.c librkflash.a -lusb-1.0 -pthread
+ *
+ * Offsets and sizes on the flash are in 512 byte sectors.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__GNUC__) && !defined(_WIN32)
+#define RKFLASH_API __attribute__((visibility("default")))
+#else
+#define RKFLASH_API
+#endif
+
+#define RKFLASH_OK                  0
+#define RKFLASH_ERROR_IO            -1  /* a transfer failed or came up short */
+#define RKFLASH_ERROR_REJECTED      -2  /* the device answered with a failed status */
+#define RKFLASH_ERROR_NO_DEVICE     -3  /* not connected, or gone */
+#define RKFLASH_ERROR_ACCESS        -4  /* no permission, or claimed by another program */
+#define RKFLASH_ERROR_INVALID       -5  /* bad argument */
+#define RKFLASH_ERROR_NO_MEM        -6
+#define RKFLASH_ERROR_TIMEOUT       -7
+
+#define RKFLASH_MODE_MASKROM        0x200
+#define RKFLASH_MODE_LOADER         0x201
+
+#define RKFLASH_PATH_MAX            32  /* "bus-port.port...", see rkflash_list */
+
+#define RKFLASH_CODE_DDR            0x471   /* rkflash_send_vendor_code: DRAM init */
+#define RKFLASH_CODE_USBPLUG        0x472   /* the loader, the device re-enumerates */
+
+typedef struct rkflash rkflash;
+
+typedef struct {
+    uint32_t flash_size;                /* sectors */
+    uint16_t block_size;                /* sectors */
+    uint8_t page_size;                  /* sectors */
+    uint8_t ecc_bits;
+    uint8_t access_time;
+    uint8_t manufacturer_id;
+    uint8_t chip_select;                /* bit mask */
+} rkflash_info;
+
+/* paths of the connected devices in mode (0 for any), at most max; count or error */
+RKFLASH_API int rkflash_list(char (*paths)[RKFLASH_PATH_MAX], int max, uint16_t mode);
+
+/* opens the device at path, the first one found if NULL */
+RKFLASH_API int rkflash_open(rkflash **dev, const char *path);
+RKFLASH_API void rkflash_close(rkflash *dev);
+
+RKFLASH_API const char *rkflash_path(const rkflash *dev);
+RKFLASH_API const char *rkflash_soc(const rkflash *dev);
+RKFLASH_API uint16_t rkflash_pid(const rkflash *dev);
+RKFLASH_API uint16_t rkflash_mode(const rkflash *dev);
+
+/* bytes per transfer (multiple of 512) and transfers in flight for read/write */
+RKFLASH_API int rkflash_set_transfer_size(rkflash *dev, uint32_t size);
+RKFLASH_API int rkflash_set_queue_depth(rkflash *dev, int depth);
+
+/* polls until the loader reports ready, RKFLASH_ERROR_TIMEOUT after timeout ms */
+RKFLASH_API int rkflash_wait_ready(rkflash *dev, int timeout);
+
+/* all zero until the usbplug has probed the storage */
+RKFLASH_API int rkflash_flash_id(rkflash *dev, uint8_t id[5]);
+RKFLASH_API int rkflash_flash_info(rkflash *dev, rkflash_info *info);
+RKFLASH_API int rkflash_chip_info(rkflash *dev, uint8_t info[16]);
+
+RKFLASH_API int rkflash_read(rkflash *dev, uint32_t offset, uint32_t nsectors, void *buf);
+RKFLASH_API int rkflash_write(rkflash *dev, uint32_t offset, uint32_t nsectors, const void *buf);
+RKFLASH_API int rkflash_erase(rkflash *dev, uint32_t offset, uint32_t nsectors);
+
+/* reboots, flag as for rkflashtool b; the device drops off the bus */
+RKFLASH_API int rkflash_reset(rkflash *dev, uint8_t flag);
+
+/*
+ * Code for a device in MASKROM mode: rkflash_vendor_code turns size bytes
+ * of a loader entry (e.g. from rkunpackfw) into the scrambled, checksummed
+ * form of rkflash_vendor_code_size(size) bytes in out and returns that
+ * size, which rkflash_send_vendor_code then uploads as index, one of
+ * RKFLASH_CODE_DDR and RKFLASH_CODE_USBPLUG.
+ */
+RKFLASH_API size_t rkflash_vendor_code_size(size_t size);
+RKFLASH_API size_t rkflash_vendor_code(uint8_t *out, const uint8_t *bin, size_t size);
+RKFLASH_API int rkflash_send_vendor_code(rkflash *dev, const uint8_t *code, size_t size, int index);
+
+RKFLASH_API const char *rkflash_strerror(int error);
+
+#endif /* !_RKFLASH_H_ */
@@ -0,0 +1,744 @@
+/*
+ * rkflashd - keeps RockUSB devices open and runs flashing jobs on them
+ *
+ * Listens on a Unix socket for jobs, one per line:
+ *
+ *   flash <device> <offset|partition> <file>
+ *   dump <device> <offset> <nsectors> <file>
+ *   dump <device> <partition> <file>
+ *   erase <device> <offset> <nsectors>
+ *   erase <device> <partition>
+ *   parameters <device> <file>
+ *   list
+ *
+ * device is a USB path as rkflashtool -u takes it, or - for the first
+ * device found.  Files are opened by the daemon, so give absolute paths.
+ * Every device gets a queue and a thread of its own that keeps it open
+ * between jobs: the libusb context, the claimed interface and what was
+ * read from the device at the start (flash id, flash info, the partition
+ * table) are only set up again after the device went away.
+ *
+ * Everything sent back is JSON, a line per message: the job queued, the
+ * job running, progress as with rkflashtool --progress=json and the end
+ * of the job:
+ *
+ *   {"job": 7, "device": "1-2", "state": "queued", "position": 1}
+ *   {"job": 7, "device": "1-2", "state": "running"}
+ *   {"job": 7, "device": "1-2", "what": "writing", "done": 1048576, ...}
+ *   {"job": 7, "device": "1-2", "state": "done", "seconds": 0.180}
+ *   {"job": 8, "device": "1-2", "state": "failed", "error": "...", "seconds": 0.002}
+ *
+ * A client may send any number of jobs on one connection and hang up
+ * without waiting for them; they run anyway.  POSIX only.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "version.h"
+#include "rkcrc.h"
+#include "rkflash.h"
+#include "rkflashtool.h"
+#include "rkparam.h"
+#include "rkprogress.h"
+
+#define RKFLASHD_DEVICES    64
+#define RKFLASHD_LINE       4096
+#define RKFLASHD_CHUNK      0x2000      /* sectors per read/write call, progress in between */
+#define RKFLASHD_TIMEOUT    1000        /* ms a slow client may hold up a status line */
+#define RKFLASHD_LOADER     0x2000      /* sectors before the first partition */
+#define RKFLASHD_PARAM      0x400       /* parameter copies are this far apart */
+#define RKFLASHD_PARAM_SIZE 0x400       /* bytes of a parameter block */
+#define RKFLASHD_PARAM_MAX  (RKFLASHD_PARAM_SIZE - 12)
+
+typedef struct {
+    int fd, refs;                       /* open until the reader and all jobs let go */
+    int dead;                           /* gone, or cut off for not reading */
+    char tail[RKFLASHD_LINE];           /* what the socket did not take of the last line */
+    size_t ntail;
+    pthread_mutex_t lock;
+} rkflashd_client;
+
+typedef struct rkflashd_job {
+    struct rkflashd_job *next;
+    int id;
+    char verb;                          /* f, d, e or P */
+    char where[64];                     /* offset or partition */
+    uint32_t nsectors;                  /* with an offset, d and e */
+    char file[PATH_MAX];
+    rkflashd_client *client;
+} rkflashd_job;
+
+typedef struct {
+    char path[RKFLASH_PATH_MAX];
+    rkflash *dev;                       /* NULL until the first job, or after it went away */
+    rkflash_info info;
+    char param[RKFLASHD_PARAM_MAX + 1]; /* parameter text, if has_param */
+    int has_param;
+    rkflashd_job *head, *tail;
+    int queued;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} rkflashd_device;
+
+static rkflashd_device devices[RKFLASHD_DEVICES];
+static int ndevices, last_id;
+static pthread_mutex_t devices_lock = PTHREAD_MUTEX_INITIALIZER;
+static int depth, blocksize;
+static const char *socket_path;
+
+static void usage(void) {
+    info("rkflashd v%d.%d\n", RKFLASHTOOL_VERSION_MAJOR, RKFLASHTOOL_VERSION_MINOR);
+    fatal("usage: rkflashd [-q depth] [-s size] socket\n"
+          "\t-q depth\tcommands kept in flight (default 4)\n"
+          "\t-s size\t\ttransfer size in bytes (default 0x8000)\n");
+}
+
+static void client_put(rkflashd_client *c) {
+    int refs;
+
+    pthread_mutex_lock(&c->lock);
+    refs = --c->refs;
+    pthread_mutex_unlock(&c->lock);
+    if (refs) return;
+    close(c->fd);
+    pthread_mutex_destroy(&c->lock);
+    free(c);
+}
+
+/*
+ * Lines to a client.  The socket does not block, so that a client that
+ * stops reading cannot stall a device.  Whatever the socket does not take
+ * of a line is kept and goes out before anything else, so lines are only
+ * ever dropped whole: progress lines while a tail is still waiting, the
+ * other lines wait for it up to RKFLASHD_TIMEOUT ms and then the client
+ * is cut off.  Called with c->lock held.
+ */
+static int client_flush(rkflashd_client *c, int timeout) {
+    double deadline = rkstats_clock() + timeout / 1e3;
+    struct pollfd p = { c->fd, POLLOUT, 0 };
+    ssize_t n;
+    int ms;
+
+    while (c->ntail && !c->dead) {
+        if ((n = write(c->fd, c->tail, c->ntail)) > 0) {
+            memmove(c->tail, c->tail + n, c->ntail - n);
+            c->ntail -= n;
+        } else if (n < 0 && errno != EAGAIN && errno != EINTR) {
+            c->dead = 1;
+        } else if ((ms = (deadline - rkstats_clock()) * 1e3) <= 0 || poll(&p, 1, ms) < 0) {
+            break;
+        }
+    }
+    return c->ntail || c->dead ? -1 : 0;
+}
+
+static void client_write(rkflashd_client *c, const char *line, size_t len, int wait) {
+    if (c->dead || len > sizeof(c->tail)) return;
+    if (client_flush(c, wait ? RKFLASHD_TIMEOUT : 0) && !wait) return;
+    if (!c->ntail) {
+        memcpy(c->tail, line, len);
+        c->ntail = len;
+        if (!client_flush(c, wait ? RKFLASHD_TIMEOUT : 0) || !wait) return;
+    }
+    if (!c->dead) {
+        info("client %d does not read, dropping it\n", c->fd);
+        shutdown(c->fd, SHUT_RDWR);
+        c->dead = 1;
+    }
+}
+
+/* a status line, which has to get through */
+static void client_send(rkflashd_client *c, const char *line) {
+    pthread_mutex_lock(&c->lock);
+    client_write(c, line, strlen(line), 1);
+    pthread_mutex_unlock(&c->lock);
+}
+
+/* a progress line, rkprogress' send */
+static void client_progress(void *ctx, const char *line, int len) {
+    rkflashd_client *c = ctx;
+
+    pthread_mutex_lock(&c->lock);
+    client_write(c, line, len, 0);
+    pthread_mutex_unlock(&c->lock);
+}
+
+/* s as a JSON string, cut short to fit size */
+static void json_string(char *out, size_t size, const char *s) {
+    size_t n = 0;
+
+    out[n++] = '"';
+    for (; *s && n + 8 < size; s++) {
+        if (*s == '"' || *s == '\\')
+            n += sprintf(out + n, "\\%c", *s);
+        else if ((unsigned char)*s < 0x20)
+            n += sprintf(out + n, "\\u%04x", *s);
+        else
+            out[n++] = *s;
+    }
+    out[n++] = '"';
+    out[n] = '\0';
+}
+
+static void job_state(rkflashd_job *job, const char *device, const char *state,
+                      const char *error, double seconds) {
+    char line[RKFLASHD_LINE], msg[1024];
+    int len;
+
+    len = snprintf(line, sizeof(line), "{\"job\": %d, \"device\": \"%s\", \"state\": \"%s\"",
+                   job->id, device, state);
+    if (error) {
+        json_string(msg, sizeof(msg), error);
+        len += snprintf(line + len, sizeof(line) - len, ", \"error\": %s", msg);
+    }
+    if (seconds >= 0)
+        len += snprintf(line + len, sizeof(line) - len, ", \"seconds\": %.3f", seconds);
+    snprintf(line + len, sizeof(line) - len, "}\n");
+    client_send(job->client, line);
+}
+
+static void device_close(rkflashd_device *d) {
+    rkflash_close(d->dev);
+    d->dev = NULL;
+    d->has_param = 0;
+}
+
+/* opens the device if it is not open yet, as the jobs below */
+static int device_open(rkflashd_device *d, char *err, size_t size) {
+    uint8_t id[5];
+    int r;
+
+    if (d->dev) return RKFLASH_OK;
+    if ((r = rkflash_open(&d->dev, d->path))) {
+        snprintf(err, size, "cannot open device: %s", rkflash_strerror(r));
+        return r;
+    }
+    if ((depth && (r = rkflash_set_queue_depth(d->dev, depth))) ||
+        (blocksize && (r = rkflash_set_transfer_size(d->dev, blocksize)))) {
+        snprintf(err, size, "cannot use queue depth %d, transfer size %#x", depth, blocksize);
+    } else {
+        rkflash_wait_ready(d->dev, 1000);
+        if ((r = rkflash_flash_id(d->dev, id)) || (r = rkflash_flash_info(d->dev, &d->info)))
+            snprintf(err, size, "cannot read flash info: %s", rkflash_strerror(r));
+        else if (!memcmp(id, "\0\0\0\0\0", 5) && (r = RKFLASH_ERROR_INVALID))
+            snprintf(err, size, "storage not probed, load the usbplug first (rkflashtool l or F)");
+    }
+    if (r) {
+        device_close(d);
+        return r;
+    }
+    info("%s: %s, %u sectors\n", d->path, rkflash_soc(d->dev), d->info.flash_size);
+    return RKFLASH_OK;
+}
+
+/*
+ * The jobs return RKFLASH_OK, what librkflash returned, or
+ * RKFLASH_ERROR_INVALID for the rest, with err set.
+ */
+
+/* the parameter text of the first intact copy on the flash */
+static int device_param(rkflashd_device *d, char *err, size_t size) {
+    uint8_t block[RKFLASHD_PARAM_SIZE];
+    uint32_t offset, len;
+    int r;
+
+    if (d->has_param) return 0;
+    for (offset = 0; offset <= RKFLASHD_LOADER; offset += RKFLASHD_PARAM) {
+        if ((r = rkflash_read(d->dev, offset, sizeof(block) >> 9, block))) {
+            snprintf(err, size, "cannot read parameters: %s", rkflash_strerror(r));
+            return r;
+        }
+        if (memcmp(block, "PARM", 4) || (len = GET32LE(block + 4)) > RKFLASHD_PARAM_MAX)
+            continue;
+        if ((uint32_t)GET32LE(block + 8 + len) != rkcrc32(0, block + 8, len))
+            continue;
+        memcpy(d->param, block + 8, len);
+        d->param[len] = '\0';
+        d->has_param = 1;
+        return 0;
+    }
+    snprintf(err, size, "no parameter block found");
+    return RKFLASH_ERROR_INVALID;
+}
+
+/* where as an offset, or the start and size of a partition; size 0 if not known */
+static int device_where(rkflashd_device *d, const char *where, uint32_t *offset, uint32_t *size,
+                        char *err, size_t esize) {
+    char *end;
+    uint32_t poff, psize;
+    int r;
+
+    *offset = strtoul(where, &end, 0);
+    *size = 0;
+    if (*where && !*end) return 0;
+
+    if ((r = device_param(d, err, esize))) return r;
+    switch (rkparam_find(d->param, where, &poff, &psize)) {
+    case 0:
+        break;
+    case RKPARAM_NO_PARTITION:
+        snprintf(err, esize, "no partition %s", where);
+        return RKFLASH_ERROR_INVALID;
+    default:
+        snprintf(err, esize, "bad mtdparts in the parameters");
+        return RKFLASH_ERROR_INVALID;
+    }
+    *offset = poff + RKFLASHD_LOADER;
+    *size = psize == RKPARAM_TO_END ? d->info.flash_size - *offset : psize;
+    return 0;
+}
+
+static int job_flash(rkflashd_device *d, rkflashd_job *job, rkprogress *p, char *err, size_t size) {
+    uint32_t offset, limit, n, done, c;
+    uint8_t *buf = NULL;
+    struct stat st;
+    ssize_t got;
+    size_t have;
+    int fd, r;
+
+    if ((r = device_where(d, job->where, &offset, &limit, err, size))) return r;
+    if ((fd = open(job->file, O_RDONLY)) < 0 || fstat(fd, &st)) {
+        snprintf(err, size, "%s: %s", job->file, strerror(errno));
+        if (fd >= 0) close(fd);
+        return RKFLASH_ERROR_INVALID;
+    }
+    n = (st.st_size + 511) >> 9;
+    if ((limit && n > limit) || offset + n > d->info.flash_size || offset + n < offset) {
+        snprintf(err, size, "%s does not fit at %#x", job->file, offset);
+        r = RKFLASH_ERROR_INVALID;
+        goto exit;
+    }
+    if (!(buf = malloc(RKFLASHD_CHUNK * 512))) {
+        snprintf(err, size, "out of memory");
+        r = RKFLASH_ERROR_NO_MEM;
+        goto exit;
+    }
+
+    /* the parameters may be overwritten from here on */
+    if (offset < RKFLASHD_LOADER + RKFLASHD_PARAM) d->has_param = 0;
+    rkprogress_start(p, d->path, "writing", offset, offset + n);
+    for (done = 0; done < n; done += c) {
+        c = n - done > RKFLASHD_CHUNK ? RKFLASHD_CHUNK : n - done;
+        for (have = 0; have < (size_t)c * 512; have += got) {
+            if ((got = read(fd, buf + have, (size_t)c * 512 - have)) < 0) {
+                snprintf(err, size, "%s: %s", job->file, strerror(errno));
+                r = RKFLASH_ERROR_INVALID;
+                goto exit;
+            }
+            if (!got) break;
+        }
+        memset(buf + have, 0, (size_t)c * 512 - have);  /* the last sector */
+        if ((r = rkflash_write(d->dev, offset + done, c, buf))) {
+            snprintf(err, size, "write at %#x: %s", offset + done, rkflash_strerror(r));
+            goto exit;
+        }
+        rkprogress_update(p, offset + done + c, 0);
+    }
+    rkprogress_finish(p);
+    r = RKFLASH_OK;
+exit:
+    free(buf);
+    close(fd);
+    return r;
+}
+
+static int job_dump(rkflashd_device *d, rkflashd_job *job, rkprogress *p, char *err, size_t size) {
+    uint32_t offset, n, done, c;
+    uint8_t *buf;
+    int fd, r = RKFLASH_ERROR_INVALID;
+
+    if ((r = device_where(d, job->where, &offset, &n, err, size))) return r;
+    if (!n) n = job->nsectors;
+    if (offset + n > d->info.flash_size || offset + n < offset) {
+        snprintf(err, size, "%#x sectors at %#x are beyond the end of the flash", n, offset);
+        return RKFLASH_ERROR_INVALID;
+    }
+    if ((fd = open(job->file, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+        snprintf(err, size, "%s: %s", job->file, strerror(errno));
+        return RKFLASH_ERROR_INVALID;
+    }
+    if (!(buf = malloc(RKFLASHD_CHUNK * 512))) {
+        snprintf(err, size, "out of memory");
+        close(fd);
+        return RKFLASH_ERROR_NO_MEM;
+    }
+
+    rkprogress_start(p, d->path, "reading", offset, offset + n);
+    for (done = 0; done < n; done += c) {
+        c = n - done > RKFLASHD_CHUNK ? RKFLASHD_CHUNK : n - done;
+        if ((r = rkflash_read(d->dev, offset + done, c, buf))) {
+            snprintf(err, size, "read at %#x: %s", offset + done, rkflash_strerror(r));
+            goto exit;
+        }
+        if (write(fd, buf, (size_t)c * 512) != (ssize_t)c * 512) {
+            snprintf(err, size, "%s: %s", job->file, strerror(errno));
+            r = RKFLASH_ERROR_INVALID;
+            goto exit;
+        }
+        rkprogress_update(p, offset + done + c, 0);
+    }
+    rkprogress_finish(p);
+    r = RKFLASH_OK;
+exit:
+    free(buf);
+    if (close(fd) && !r) {
+        snprintf(err, size, "%s: %s", job->file, strerror(errno));
+        r = RKFLASH_ERROR_INVALID;
+    }
+    return r;
+}
+
+static int job_erase(rkflashd_device *d, rkflashd_job *job, rkprogress *p, char *err, size_t size) {
+    uint32_t offset, n, done, c;
+    int r;
+
+    if ((r = device_where(d, job->where, &offset, &n, err, size))) return r;
+    if (!n) n = job->nsectors;
+    if (offset + n > d->info.flash_size || offset + n < offset) {
+        snprintf(err, size, "%#x sectors at %#x are beyond the end of the flash", n, offset);
+        return RKFLASH_ERROR_INVALID;
+    }
+
+    rkprogress_start(p, d->path, "erasing", offset, offset + n);
+    for (done = 0; done < n; done += c) {
+        c = n - done > RKFLASHD_CHUNK * 8 ? RKFLASHD_CHUNK * 8 : n - done;
+        if ((r = rkflash_erase(d->dev, offset + done, c))) {
+            snprintf(err, size, "erase at %#x: %s", offset + done, rkflash_strerror(r));
+            break;
+        }
+        rkprogress_update(p, offset + done + c, 0);
+    }
+    if (!r) rkprogress_finish(p);
+    if (offset < RKFLASHD_LOADER + RKFLASHD_PARAM) d->has_param = 0;
+    return r;
+}
+
+/* writes the file as parameters, a copy every RKFLASHD_PARAM sectors up to the loader end */
+static int job_param(rkflashd_device *d, rkflashd_job *job, rkprogress *p, char *err, size_t size) {
+    uint8_t block[RKFLASHD_PARAM_SIZE], extra;
+    uint32_t offset;
+    ssize_t len;
+    int fd, r;
+
+    memset(block, 0, sizeof(block));
+    if ((fd = open(job->file, O_RDONLY)) < 0) {
+        snprintf(err, size, "%s: %s", job->file, strerror(errno));
+        return RKFLASH_ERROR_INVALID;
+    }
+    len = read(fd, block + 8, RKFLASHD_PARAM_MAX);
+    if (len >= 0 && read(fd, &extra, 1) > 0) {
+        snprintf(err, size, "%s is longer than %d bytes", job->file, RKFLASHD_PARAM_MAX);
+        len = -2;
+    } else if (len < 0) {
+        snprintf(err, size, "%s: %s", job->file, strerror(errno));
+    }
+    close(fd);
+    if (len < 0) return RKFLASH_ERROR_INVALID;
+    memcpy(block, "PARM", 4);
+    PUT32LE(block + 4, (uint32_t)len);
+    PUT32LE(block + 8 + len, rkcrc32(0, block + 8, len));
+
+    d->has_param = 0;
+    rkprogress_start(p, d->path, "writing parameters", 0,
+                     (RKFLASHD_LOADER / RKFLASHD_PARAM + 1) * (sizeof(block) >> 9));
+    for (offset = 0; offset <= RKFLASHD_LOADER; offset += RKFLASHD_PARAM) {
+        if ((r = rkflash_write(d->dev, offset, sizeof(block) >> 9, block))) {
+            snprintf(err, size, "write at %#x: %s", offset, rkflash_strerror(r));
+            return r;
+        }
+        rkprogress_update(p, 0, sizeof(block) >> 9);
+    }
+    rkprogress_finish(p);
+    return RKFLASH_OK;
+}
+
+static void job_run(rkflashd_device *d, rkflashd_job *job) {
+    rkprogress p = { .mode = RKPROGRESS_JSON, .fd = -1, .job = job->id,
+                     .send = client_progress, .ctx = job->client };
+    double t0 = rkstats_clock();
+    char err[PATH_MAX + 128];
+    int r;
+
+    job_state(job, d->path, "running", NULL, -1);
+    pthread_mutex_init(&p.lock, NULL);
+    if (!(r = device_open(d, err, sizeof(err)))) {
+        switch (job->verb) {
+        case 'f': r = job_flash(d, job, &p, err, sizeof(err)); break;
+        case 'd': r = job_dump(d, job, &p, err, sizeof(err)); break;
+        case 'e': r = job_erase(d, job, &p, err, sizeof(err)); break;
+        case 'P': r = job_param(d, job, &p, err, sizeof(err)); break;
+        }
+        /* the device may be gone; open it afresh for the next job */
+        if (r == RKFLASH_ERROR_NO_DEVICE || r == RKFLASH_ERROR_IO)
+            device_close(d);
+    }
+    pthread_mutex_destroy(&p.lock);
+    job_state(job, d->path, r ? "failed" : "done", r ? err : NULL, rkstats_clock() - t0);
+}
+
+static void *device_worker(void *arg) {
+    rkflashd_device *d = arg;
+    rkflashd_job *job;
+
+    for (;;) {
+        pthread_mutex_lock(&d->lock);
+        while (!d->head)
+            pthread_cond_wait(&d->cond, &d->lock);
+        job = d->head;
+        if (!(d->head = job->next)) d->tail = NULL;
+        pthread_mutex_unlock(&d->lock);
+
+        job_run(d, job);
+
+        pthread_mutex_lock(&d->lock);
+        d->queued--;
+        pthread_mutex_unlock(&d->lock);
+        client_put(job->client);
+        free(job);
+    }
+    return NULL;
+}
+
+/* the device at path, with a worker started on first use; NULL if there are too many */
+static rkflashd_device *device_get(const char *path) {
+    rkflashd_device *d = NULL;
+    pthread_t thread;
+    int i;
+
+    pthread_mutex_lock(&devices_lock);
+    for (i = 0; i < ndevices && strcmp(devices[i].path, path); i++);
+    if (i < ndevices) {
+        d = &devices[i];
+    } else if (ndevices < RKFLASHD_DEVICES) {
+        d = &devices[ndevices];
+        snprintf(d->path, sizeof(d->path), "%s", path);
+        pthread_mutex_init(&d->lock, NULL);
+        pthread_cond_init(&d->cond, NULL);
+        if (pthread_create(&thread, NULL, device_worker, d))
+            d = NULL;
+        else
+            pthread_detach(thread), ndevices++;
+    }
+    pthread_mutex_unlock(&devices_lock);
+    return d;
+}
+
+static void client_error(rkflashd_client *c, const char *error) {
+    char line[RKFLASHD_LINE], msg[1024];
+
+    json_string(msg, sizeof(msg), error);
+    snprintf(line, sizeof(line), "{\"error\": %s}\n", msg);
+    client_send(c, line);
+}
+
+static void client_list(rkflashd_client *c) {
+    char paths[RKFLASHD_DEVICES][RKFLASH_PATH_MAX], line[RKFLASHD_LINE];
+    int n = rkflash_list(paths, RKFLASHD_DEVICES, 0), len, i;
+
+    if (n < 0) {
+        client_error(c, rkflash_strerror(n));
+        return;
+    }
+    len = snprintf(line, sizeof(line), "{\"devices\": [");
+    for (i = 0; i < n; i++)
+        len += snprintf(line + len, sizeof(line) - len, "%s\"%s\"", i ? ", " : "", paths[i]);
+    snprintf(line + len, sizeof(line) - len, "]}\n");
+    client_send(c, line);
+}
+
+/* parses a job line and queues it on its device */
+static void client_line(rkflashd_client *c, char *line) {
+    char *verb, *path, *where, *rest, *end, first[RKFLASH_PATH_MAX], msg[RKFLASHD_LINE];
+    rkflashd_device *d;
+    rkflashd_job *job;
+    int position;
+
+    if (!(verb = strtok_r(line, " \t\r", &rest))) return;
+    if (!strcmp(verb, "list")) {
+        client_list(c);
+        return;
+    }
+    if (!(job = calloc(1, sizeof(rkflashd_job)))) {
+        client_error(c, "out of memory");
+        return;
+    }
+    path = strtok_r(NULL, " \t\r", &rest);
+    where = !strcmp(verb, "parameters") ? "0" : strtok_r(NULL, " \t\r", &rest);
+    if (!strcmp(verb, "flash")) job->verb = 'f';
+    else if (!strcmp(verb, "dump")) job->verb = 'd';
+    else if (!strcmp(verb, "erase")) job->verb = 'e';
+    else if (!strcmp(verb, "parameters")) job->verb = 'P';
+    if (!job->verb || !path || !where || strlen(where) >= sizeof(job->where)) {
+        client_error(c, "usage: flash|dump|erase|parameters device ..., or list");
+        free(job);
+        return;
+    }
+    snprintf(job->where, sizeof(job->where), "%s", where);
+
+    /* an offset takes a sector count for d and e; files are the rest of the line */
+    strtoul(where, &end, 0);
+    if ((job->verb == 'd' || job->verb == 'e') && !*end) {
+        char *n = strtok_r(NULL, " \t\r", &rest);
+        if (!n || !(job->nsectors = strtoul(n, &end, 0)) || *end) {
+            client_error(c, "usage: dump|erase device offset nsectors ...");
+            free(job);
+            return;
+        }
+    }
+    rest += strspn(rest, " \t");
+    rest[strcspn(rest, "\r")] = '\0';
+    if ((job->verb != 'e') != (*rest != '\0') || strlen(rest) >= sizeof(job->file)) {
+        client_error(c, job->verb == 'e' ? "erase takes no file" : "file missing");
+        free(job);
+        return;
+    }
+    snprintf(job->file, sizeof(job->file), "%s", rest);
+
+    if (!strcmp(path, "-")) {
+        char (*paths)[RKFLASH_PATH_MAX] = &first;
+        if (rkflash_list(paths, 1, 0) < 1) {
+            client_error(c, rkflash_strerror(RKFLASH_ERROR_NO_DEVICE));
+            free(job);
+            return;
+        }
+        path = first;
+    }
+    if (!(d = device_get(path))) {
+        snprintf(msg, sizeof(msg), "more than %d devices", RKFLASHD_DEVICES);
+        client_error(c, msg);
+        free(job);
+        return;
+    }
+
+    pthread_mutex_lock(&c->lock);
+    c->refs++;
+    pthread_mutex_unlock(&c->lock);
+    job->client = c;
+
+    pthread_mutex_lock(&devices_lock);
+    job->id = ++last_id;
+    pthread_mutex_unlock(&devices_lock);
+
+    /* told before the worker can get to it, so that queued comes first */
+    pthread_mutex_lock(&d->lock);
+    position = ++d->queued;
+    pthread_mutex_unlock(&d->lock);
+    snprintf(msg, sizeof(msg), "{\"job\": %d, \"device\": \"%s\", \"state\": \"queued\", "
+             "\"position\": %d}\n", job->id, d->path, position);
+    client_send(c, msg);
+
+    pthread_mutex_lock(&d->lock);
+    if (d->tail) d->tail->next = job;
+    else d->head = job;
+    d->tail = job;
+    pthread_cond_signal(&d->cond);
+    pthread_mutex_unlock(&d->lock);
+}
+
+static void *client_reader(void *arg) {
+    rkflashd_client *c = arg;
+    struct pollfd p = { c->fd, POLLIN, 0 };
+    char buf[RKFLASHD_LINE], *nl;
+    size_t len = 0;
+    ssize_t n;
+
+    for (;;) {
+        if ((n = read(c->fd, buf + len, sizeof(buf) - 1 - len)) < 0 && errno == EAGAIN) {
+            poll(&p, 1, -1);
+            continue;
+        }
+        if (n <= 0) break;
+        len += n;
+        buf[len] = '\0';
+        while ((nl = strchr(buf, '\n'))) {
+            *nl = '\0';
+            client_line(c, buf);
+            len -= nl + 1 - buf;
+            memmove(buf, nl + 1, len + 1);
+        }
+        if (len == sizeof(buf) - 1) {
+            client_error(c, "line too long");
+            break;
+        }
+    }
+    client_put(c);
+    return NULL;
+}
+
+static void stop(int sig) {
+    (void)sig;
+    unlink(socket_path);
+    _exit(0);
+}
+
+int main(int argc, char **argv) {
+    struct sockaddr_un addr;
+    rkflashd_client *c;
+    pthread_t thread;
+    int ch, s, fd;
+
+    while ((ch = getopt(argc, argv, "q:s:")) != -1) {
+        switch (ch) {
+        case 'q': depth = strtoul(optarg, NULL, 0); break;
+        case 's': blocksize = strtoul(optarg, NULL, 0); break;
+        default: usage();
+        }
+    }
+    if (argc - optind != 1) usage();
+    socket_path = argv[optind];
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(addr.sun_path))
+        fatal("%s: path too long\n", socket_path);
+    strcpy(addr.sun_path, socket_path);
+    if ((s = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+        fatal("socket: %s\n", strerror(errno));
+    /* a socket left over from a daemon that did not get to clean up */
+    if (connect(s, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+        fatal("%s: another rkflashd is listening\n", socket_path);
+    unlink(socket_path);
+    close(s);
+    if ((s = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+        bind(s, (struct sockaddr *)&addr, sizeof(addr)) || listen(s, 16))
+        fatal("%s: %s\n", socket_path, strerror(errno));
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, stop);
+    signal(SIGTERM, stop);
+    info("listening on %s\n", socket_path);
+
+    for (;;) {
+        if ((fd = accept(s, NULL, NULL)) < 0) {
+            if (errno != EINTR && errno != ECONNABORTED)
+                info("accept: %s\n", strerror(errno));
+            continue;
+        }
+        if (!(c = calloc(1, sizeof(rkflashd_client)))) {
+            close(fd);
+            continue;
+        }
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        c->fd = fd;
+        c->refs = 1;
+        pthread_mutex_init(&c->lock, NULL);
+        if (pthread_create(&thread, NULL, client_reader, c)) {
+            client_put(c);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+}
@@ -31,13 +31,21 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <unistd.h>
+#include <getopt.h>
 #include <string.h>
 #include <errno.h>
+#include <sys/stat.h>
 
 /* hack to set binary mode for stdin / stdout on Windows */
 #ifdef _WIN32
 #include <fcntl.h>
 int _CRT_fmode = _O_BINARY;
+#define popen _popen
+#define pclose _pclose
+#else
+#include <fcntl.h>
+#include <sys/select.h>
+#include <sys/wait.h>
 #endif
 
 #include "version.h"
@@ -45,7 +53,35 @@ int _CRT_fmode = _O_BINARY;
 #include "rkcrc.h"
 #include "rkflashtool.h"
 #include "rkidb.h"
+#include "rkinfo.h"
 #include "rkusb.h"
+#include "rkpipe.h"
+#include "rkblank.h"
+#include "rksparse.h"
+#include "rkjournal.h"
+#include "rkparam.h"
+#include "rkprogress.h"
+
+/* --progress: one phase at a time, whichever device this process drives */
+static rkprogress progress = { .mode = RKPROGRESS_HUMAN, .fd = 2, .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static void rkprogress_begin(const char *device, const char *what, uint32_t start, uint32_t end) {
+    rkprogress_start(&progress, device, what, start, end);
+}
+
+/* everything below sector end is done */
+static void rkprogress_at(uint32_t end) {
+    rkprogress_update(&progress, end, 0);
+}
+
+/* nsectors more are done, for phases that do not go in flash order */
+static void rkprogress_add(uint32_t nsectors) {
+    rkprogress_update(&progress, 0, nsectors);
+}
+
+static void rkprogress_end(void) {
+    rkprogress_finish(&progress);
+}
 
 static void usage(void) {
     info("rkflashtool v%d.%d\n", RKFLASHTOOL_VERSION_MAJOR,
@@ -54,6 +90,7 @@ static void usage(void) {
     fatal( "usage:\n"
           "\trkflashtool l file               \t\tload DDRINIT & USBPLUG from packed rockchip bootloader (MASKROM MODE)\n"	  
           "\trkflashtool a file               \t\tinstall/update bootloader from packed rockchip bootloader\n"
+          "\trkflashtool F file [parameter] [partname file]...\tload usbplug, install bootloader, parameters and partitions (MASKROM MODE)\n"
           "\trkflashtool b [flag]             \t\treboot device\n"
           "\trkflashtool d > outfile          \t\tdump full internal memory to image file\n"
           "\trkflashtool e                    \t\twipe flash\n"
@@ -70,161 +107,708 @@ static void usage(void) {
 //        "\trkflashtool z                   \tlist partitions\n"
 //        "\trkflashtool w partname infile  \twrite flash partition\n"
 //        "\trkflashtool w offset nsectors <infile  \twrite flash\n"
+          "options:\n"
+          "\t-B                               \t\tf: skip zero-filled blocks, erase 0xff-filled ones\n"
+          "\t-D                               \t\tf: read back first, only write what differs\n"
+          "\t-R                               \t\tlike -V, and rewrite what reads back differently\n"
+          "\t-V                               \t\tf, a, P, F: read back and check written data\n"
+          "\t-m                               \t\trun on all connected devices at once\n"
+          "\t-q depth                         \t\tcommands kept in flight (default %d)\n"
+          "\t-s size|auto                     \t\ttransfer size in bytes (default %#x), auto probes the loader\n"
+          "\t-u bus-port[.port...]            \t\tuse the device at this USB path\n"
+          "\t-w maskrom|loader|any            \t\twait for a device in this mode, with -m keep running jobs as devices arrive\n"
+          "\t-z gzip|xz|zstd                  \t\td, r: compress the dump\n"
+          "\t--resume journal                 \t\td, r, f: checkpoint to journal and carry on from it\n"
+          "\t--stats[=json]                   \t\tcount and time every command type, print it at exit\n"
+          "\t--progress=human|json|none       \t\thow to report progress (default human)\n"
+          "\t--progress-fd fd                 \t\twrite progress to this file descriptor (default 2)\n",
+          RKFT_QUEUE_DEPTH, RKFT_BLOCKSIZE
+         );
+}
 
+/*
+ * Transfer sizes found with -s auto are remembered per SoC in
+ * ~/.rkflashtool, one "pid size" pair per line.
+ */
+static FILE *tune_cache_open(const char *mode) {
+    char path[4096];
+    const char *home = getenv("HOME");
 
-         );
+    if (!home) return NULL;
+    snprintf(path, sizeof(path), "%s/.rkflashtool", home);
+    return fopen(path, mode);
 }
 
-#define NEXT do { argc--;argv++; } while(0)
+static uint32_t tune_cache_get(uint16_t pid) {
+    unsigned int p, size;
+    uint32_t found = 0;
+    FILE *fp = tune_cache_open("r");
 
-int main(int argc, char **argv) {
-    FILE *fp = NULL;
-    long offset = 0, size = 0, isize = 0;
-    uint8_t flag = 0, wipe = 0, *tmpBuf = NULL;
-    char action, name[ MAX_NAME_LEN + 1] , *partname = NULL, *ifile = NULL, *bootfile = NULL;
-    rkusb_device *di = NULL;
-    nand_info *nand = NULL;
-    rk_boot_header hdr;
-    rk_boot_entry *entrys = NULL;
-    rk_boot_data boot_data = { .ddrbin = NULL,
-        .ddrbin_size = 0,
-        .usbplug = NULL,
-        .usbplug_size = 0,
-        .flashboot = NULL,
-        .flashboot_size = 0,
-        .flashdata = NULL,
-        .flashdata_size = 0
-    };
-    rkidb *idbheader;
+    if (!fp) return 0;
+    while (fscanf(fp, "%x %x", &p, &size) == 2)
+        if (p == pid) found = size;
+    fclose(fp);
+    return found;
+}
 
-    NEXT; if (!argc) usage();
+static void tune_cache_put(uint16_t pid, uint32_t size) {
+    unsigned int p[64], s[64];
+    int n = 0;
+    FILE *fp = tune_cache_open("r");
 
-    action = **argv; NEXT;
-    
-    switch(action) {
-    case 'b':
-        if (argc > 1) usage();
-        else if (argc == 1)
-            flag = strtoul(argv[0], NULL, 0);
-        break;
-    case 'a':
-    case 'l':
-        if (argc != 1) usage();
-            bootfile = argv[0];
-        break;
-    case 'f':
-        if (argc < 1 || argc > 2) usage();        
-	if (argc == 1) {
-            ifile = argv[0];
-	    size = (int) nand->flash_size;
-	} else {
-	    partname = argv[0];
-	    ifile = argv[1];
-	}
-        break;
-    case 'e':
-        if (argc > 2) usage();
-        if (argc == 1) {
-            partname = argv[0];
-        } else if (argc == 2) {
-            offset = strtoul(argv[0], NULL, 0);
-            size   = strtoul(argv[1], NULL, 0);
-        } else {
-            wipe = 1;
+    if (fp) {
+        while (n < 64 && fscanf(fp, "%x %x", &p[n], &s[n]) == 2)
+            if (p[n] != pid) n++;
+        fclose(fp);
+    }
+    if (!(fp = tune_cache_open("w"))) return;
+    for (int i = 0; i < n; i++)
+        fprintf(fp, "%04x %#x\n", p[i], s[i]);
+    fprintf(fp, "%04x %#x\n", pid, size);
+    fclose(fp);
+}
+
+typedef struct {
+    int fd, sparse;
+    uint32_t holes;                     /* sectors seeked over */
+    rkjournal *j;                       /* --resume */
+} dump_job;
+
+/* writer stage of r/d: chunks arrive in flash order.  In sparse files
+ * zero-filled granules are seeked over and left as holes. */
+static int write_chunk(void *ctx, rkusb_slot *slot) {
+    dump_job *job = ctx;
+    uint32_t i, j, n, len = slot->length, grain = RKFT_BLANK_GRAIN * 512;
+    int hole = 0;
+
+    if (slot->error) return -1;
+    rkprogress_at(slot->offset + slot->nsectors);
+
+    for (i = 0; i < len; i = j) {
+        hole = job->sparse && rkblank(slot->buf + i, len - i < grain ? len - i : grain) == RKBLANK_ZERO;
+        for (j = i + grain; job->sparse && j < len; j += grain) {
+            n = len - j < grain ? len - j : grain;
+            if ((rkblank(slot->buf + j, n) == RKBLANK_ZERO) != hole) break;
         }
-        break;
-    case 'r':
-    //case 'w':
-        if (argc < 1 || argc > 2) usage();
-        if (argc == 1) {
-            partname = argv[0];
-        } else {
-            offset = strtoul(argv[0], NULL, 0);
-            size   = strtoul(argv[1], NULL, 0);
+        if (!job->sparse || j > len) j = len;
+
+        if (hole) {
+            if (lseek(job->fd, j - i, SEEK_CUR) < 0)
+                fatal("seek error: %s\n", strerror(errno));
+            job->holes += (j - i) >> 9;
+        } else if (write(job->fd, slot->buf + i, j - i) <= 0) {
+            fatal("Write error! Disk full?\n");
         }
-	partname = argv[0];
-	ifile = argv[1];
-        break;  
-    case 'n':
-    case 'v':
-    case 'p':
-    case 'P':
-    case 'd':
-        if (argc) usage();
-        offset = 0;
-        size   = 1024;
-        break;    
-    default:
-        usage();
     }
+    if (job->j) {
+        /* a checkpoint must not cover a hole past the end of the file */
+#ifndef _WIN32
+        if (hole && ftruncate(job->fd, lseek(job->fd, 0, SEEK_CUR)))
+            fatal("Write error! %s\n", strerror(errno));
+#endif
+        if (rkjournal_push(job->j, slot->offset, slot->offset + slot->nsectors, 0) ||
+            rkjournal_done(job->j, slot->offset))
+            fatal("cannot write %s: %s\n", job->j->name, strerror(errno));
+    }
+    return 1;
+}
 
-    if (bootfile) {
+/* holes only pay off in a regular file we write from its current end */
+static int dump_sparse(int fd) {
+#ifdef _WIN32
+    (void)fd;
+    return 0;
+#else
+    struct stat st;
+    off_t pos = lseek(fd, 0, SEEK_CUR);
 
-        info ("loading bootloader file %s\n", bootfile);
-        fp = fopen(bootfile , "rb");
-        if (fp == NULL) {
-            fatal("unable to open %s file\n", bootfile); 
-        }
+    return !fstat(fd, &st) && S_ISREG(st.st_mode) && pos >= 0 && st.st_size <= pos &&
+           !(fcntl(fd, F_GETFL) & O_APPEND);
+#endif
+}
 
-        if ( !fread(&hdr, sizeof(rk_boot_header), 1, fp) ) {
-            fatal("unable to read %s file\n", bootfile); 
+/* gives the file its full length if it ends in a hole, and reports */
+static void dump_finish(dump_job *job) {
+#ifndef _WIN32
+    struct stat st;
+    off_t pos = lseek(job->fd, 0, SEEK_CUR);
+
+    if (ftruncate(job->fd, pos) || fstat(job->fd, &st))
+        fatal("Write error! %s\n", strerror(errno));
+    info("%u sectors left as holes, %lld of %lld KiB allocated\n", job->holes,
+         (long long)st.st_blocks / 2, (long long)st.st_size >> 10);
+#else
+    (void)job;
+#endif
+}
+
+/*
+ * --resume for d/r: opens the journal and, if a previous run got anywhere,
+ * checks that stdout holds its output and that the last sectors in there
+ * still match the device, then carries on right after them.  Returns the
+ * sector to start reading from.
+ */
+static uint32_t dump_resume(const char *name, rkusb_device *di, nand_info *nand,
+                            uint32_t offset, uint32_t size, uint32_t incr, dump_job *job) {
+    char key[128];
+    struct stat st;
+    uint32_t at, n;
+    off_t len;
+    uint8_t *tail;
+
+    snprintf(key, sizeof(key), "rkflashtool r %x %x %x %04x %08x", offset, size, incr,
+             di->pid, rkcrc32(0, (uint8_t *)nand, sizeof(*nand)));
+    if (rkjournal_open(job->j, name, key, offset)) {
+        if (!errno) fatal("%s is the journal of another transfer\n", name);
+        fatal("cannot open %s: %s\n", name, strerror(errno));
+    }
+    if (!fstat(1, &st) && S_ISREG(st.st_mode))
+        job->j->sync = 1;
+    if ((at = job->j->resume) == offset)
+        return offset;
+
+    len = (off_t)(at - offset) * 512;
+    if (job->j->sync < 0 || st.st_size < len)
+        fatal("stdout must be the dump being resumed, opened with >> or 1<>\n");
+    n = at - offset < incr ? at - offset : incr;
+    if (!(tail = malloc(n * 512)))
+        fatal("out of memory\n");
+    rkusb_send_cmd(di, RKFT_CMD_READLBA, at - n, n);
+    rkusb_recv_buf(di, n * 512);
+    rkusb_recv_res(di);
+    /* stdout opened with >> cannot be read back, only 1<> can */
+    if (lseek(1, len - n * 512, SEEK_SET) >= 0 && read(1, tail, n * 512) == n * 512) {
+        if (rkusb_res_status(di) || memcmp(tail, di->buf, n * 512))
+            fatal("the dump does not match this device\n");
+    } else {
+        info("cannot read back stdout, not checking it against the device\n");
+    }
+    free(tail);
+    if (ftruncate(1, len) || lseek(1, len, SEEK_SET) < 0)
+        fatal("seek error: %s\n", strerror(errno));
+    job->sparse = dump_sparse(1);
+    info("resuming at 0x%08x, %u sectors already done\n", at, at - offset);
+    return at;
+}
+
+/* sorted list of [start, end) sector ranges */
+typedef struct {
+    uint32_t (*r)[2], n;
+} lba_ranges;
+
+static int add_range(lba_ranges *l, uint32_t offset, uint32_t nsectors) {
+    uint32_t (*r)[2];
+
+    if (l->n && l->r[l->n - 1][1] == offset) {
+        l->r[l->n - 1][1] += nsectors;
+        return 0;
+    }
+    if (!(r = realloc(l->r, (l->n + 1) * sizeof(*r)))) return -1;
+    l->r = r;
+    r[l->n][0] = offset;
+    r[l->n][1] = offset + nsectors;
+    l->n++;
+    return 0;
+}
+
+typedef struct {
+    int verify, rewrite;
+    uint32_t verified, rewritten;
+    lba_ranges bad;                     /* read back differently */
+} verify_state;
+
+/*
+ * Consumer side of -V: a finished WRITELBA is turned into a READLBA of the
+ * same range, its data kept aside, and the readback compared by checksum.
+ * With -R a mismatching range is written again up to RKFT_VERIFY_RETRIES
+ * times.  slot->tries counts the writes of the chunk.
+ */
+static int verify_slot(verify_state *v, rkusb_slot *slot) {
+    if (slot->command == RKFT_CMD_WRITELBA) {
+        if (!v->verify) return 1;
+        if (!rkusb_slot_aux(slot)) return -1;
+        slot->crc = rkcrc32(0, slot->buf, slot->length);
+        slot->tries++;
+        rkusb_slot_swap(slot);
+        rkusb_slot_cmd(slot, RKFT_CMD_READLBA, slot->offset, slot->nsectors);
+        return RKUSB_STAGE_AGAIN;
+    }
+
+    if (rkcrc32(0, slot->buf, slot->length) == slot->crc) {
+        v->verified += slot->nsectors;
+        return 1;
+    }
+    if (v->rewrite && slot->tries <= RKFT_VERIFY_RETRIES) {
+        v->rewritten += slot->nsectors;
+        rkusb_slot_swap(slot);
+        rkusb_slot_cmd(slot, RKFT_CMD_WRITELBA, slot->offset, slot->nsectors);
+        return RKUSB_STAGE_AGAIN;
+    }
+    return add_range(&v->bad, slot->offset, slot->nsectors) ? -1 : 1;
+}
+
+/* prints the outcome of -V; nonzero when something did not read back */
+static int verify_report(verify_state *v) {
+    uint32_t i;
+
+    if (!v->verify) return 0;
+    for (i = 0; i < v->bad.n; i++)
+        info("verify: sectors 0x%08x-0x%08x differ\n", v->bad.r[i][0], v->bad.r[i][1] - 1);
+    if (v->rewritten)
+        info("verify: %u sectors rewritten\n", v->rewritten);
+    if (!v->bad.n)
+        info("verify: %u sectors ok\n", v->verified);
+    free(v->bad.r);
+    v->bad.r = NULL;
+    return v->bad.n != 0;
+}
+
+/* compressed images are recognized by their magic and piped through these */
+static const struct {
+    const char *magic;
+    size_t len;
+    const char *cmd;
+} decompressors[] = {
+    { "\x1f\x8b", 2, "gzip -dc" },
+    { "\xfd" "7zXZ\0", 6, "xz -T0 -dc" },
+    { "\x28\xb5\x2f\xfd", 4, "zstd -T0 -dc" },
+};
+
+/* -z: dumps are piped through one of these, all cores where supported */
+static const struct {
+    const char *name, *cmd;
+} compressors[] = {
+    { "gzip", "gzip -c" },
+    { "xz",   "xz -T0 -c" },
+    { "zstd", "zstd -T0 -q -c" },
+};
+
+/* opens an image, decompressing it on the fly in a separate process */
+static FILE *open_image(const char *name, int *piped) {
+    char magic[8], *cmd, *p;
+    size_t len, i;
+    FILE *fp;
+
+    *piped = 0;
+    if (!(fp = fopen(name, "rb"))) return NULL;
+    len = fread(magic, 1, sizeof(magic), fp);
+    rewind(fp);
+
+    for (i = 0; i < sizeof(decompressors) / sizeof(decompressors[0]); i++) {
+        if (len < decompressors[i].len || memcmp(magic, decompressors[i].magic, decompressors[i].len))
+            continue;
+        if (!(p = cmd = malloc(strlen(decompressors[i].cmd) + 4 * strlen(name) + 8)))
+            return fp;
+#ifdef _WIN32
+        p += sprintf(p, "%s < \"%s\"", decompressors[i].cmd, name);
+#else
+        p += sprintf(p, "%s < '", decompressors[i].cmd);
+        for (const char *q = name; *q; q++)
+            p += *q == '\'' ? sprintf(p, "'\\''") : sprintf(p, "%c", *q);
+        sprintf(p, "'");
+#endif
+        info("decompressing with %s\n", decompressors[i].cmd);
+        fclose(fp);
+        *piped = 1;
+        fp = popen(cmd, "r");
+        free(cmd);
+        break;
+    }
+    return fp;
+}
+
+typedef struct {
+    FILE *fp;
+    uint32_t offset, end, incr;
+    int eof, pad, piped;
+    uint8_t head[sizeof(sparse_header)];    /* bytes read to look for a sparse header */
+    size_t nhead, hpos;
+    /* -B: one classified granule of look-ahead at offset */
+    int kind;
+    uint32_t grain, n;
+    uint8_t *look;
+    uint32_t written, erased, skipped, unchanged;
+    lba_ranges failed;                  /* ERASE_LBA ranges the loader rejected */
+    verify_state v;
+    /* sparse images: chunk being streamed and bytes of it left */
+    sparse_header simg;
+    uint32_t chunks, type, fill;
+    uint64_t left;
+    int blank;
+    /* --resume: the real reader, and chunks replayed up to the journal mark */
+    rkjournal *j;
+    rkusb_stage read;
+    uint32_t hash, resumed;
+    int replay;
+} flash_job;
+
+/* the input may be a pipe: no seeking, and the header read ahead comes first */
+static size_t job_read(flash_job *job, void *buf, size_t len) {
+    size_t n = job->nhead - job->hpos;
+
+    if (n > len) n = len;
+    memcpy(buf, job->head + job->hpos, n);
+    job->hpos += n;
+    return n < len ? n + fread((uint8_t *)buf + n, 1, len - n, job->fp) : n;
+}
+
+static int job_skip(flash_job *job, uint64_t len) {
+    uint8_t tmp[4096];
+    size_t n;
+
+    for (; len; len -= n) {
+        n = len < sizeof(tmp) ? len : sizeof(tmp);
+        if (job_read(job, tmp, n) != n) return -1;
+    }
+    return 0;
+}
+
+/* reads up to n sectors at 'at': whole images stop at end-of-file,
+ * partitions are padded with zeros up to their end */
+static uint32_t read_sectors(flash_job *job, uint8_t *buf, uint32_t at, uint32_t n) {
+    size_t len = 0;
+
+    if (at >= job->end) return 0;
+    if (n > job->end - at) n = job->end - at;
+
+    if (!job->eof) {
+        len = job_read(job, buf, n * 512);
+        if (len < n * 512) job->eof = 1;
+    }
+    if (!len && !job->pad) return 0;
+    if (!job->pad) n = (len + 511) >> 9;
+    memset(buf + len, 0, n * 512 - len);
+    return n;
+}
+
+/* reader stage of f */
+static int read_chunk(void *ctx, rkusb_slot *slot) {
+    flash_job *job = ctx;
+    uint32_t n = read_sectors(job, slot->buf, job->offset, job->incr);
+
+    if (!n) return 0;
+    rkusb_slot_cmd(slot, RKFT_CMD_WRITELBA, job->offset, n);
+    job->offset += n;
+    job->written += n;
+    return 1;
+}
+
+/* reader stage of f -D: the chunk is kept aside with its checksum while
+ * the same range is read back from the device */
+static int read_diff(void *ctx, rkusb_slot *slot) {
+    flash_job *job = ctx;
+    uint8_t *data = rkusb_slot_aux(slot);
+    uint32_t n;
+
+    if (!data) return -1;
+    if (!(n = read_sectors(job, data, job->offset, job->incr))) return 0;
+    slot->crc = rkcrc32(0, data, n * 512);
+    rkusb_slot_cmd(slot, RKFT_CMD_READLBA, job->offset, n);
+    job->offset += n;
+    return 1;
+}
+
+/* the granule at 'at', which is where the run being gathered ends */
+static uint32_t peek_grain(flash_job *job, uint32_t at) {
+    if (!job->n) {
+        job->n = read_sectors(job, job->look, at, job->grain);
+        job->kind = rkblank(job->look, job->n * 512);
+    }
+    return job->n;
+}
+
+/* reader stage of f -B: zero granules are skipped, 0xff granules become
+ * ERASE_LBA commands and runs of data granules are sent in one WRITELBA */
+static int read_sparse(void *ctx, rkusb_slot *slot) {
+    flash_job *job = ctx;
+    uint32_t n = 0, max;
+    int kind;
+
+    while (peek_grain(job, job->offset) && job->kind == RKBLANK_ZERO) {
+        job->skipped += job->n;
+        job->offset += job->n;
+        job->n = 0;
+    }
+    if (!job->n) return 0;
+
+    kind = job->kind;
+    max = kind == RKBLANK_DATA ? job->incr : RKFT_ERASE_INCR;
+    do {
+        if (kind == RKBLANK_DATA)
+            memcpy(slot->buf + n * 512, job->look, job->n * 512);
+        n += job->n;
+        job->n = 0;
+    } while (peek_grain(job, job->offset + n) && job->kind == kind && n + job->n <= max);
+
+    if (kind == RKBLANK_DATA) {
+        rkusb_slot_cmd(slot, RKFT_CMD_WRITELBA, job->offset, n);
+        job->written += n;
+    } else {
+        rkusb_slot_cmd(slot, RKFT_CMD_ERASE_LBA, job->offset, n);
+        job->erased += n;
+    }
+    job->offset += n;
+    return 1;
+}
+
+/* moves to the next RAW or FILL chunk of a sparse image */
+static int simg_chunk(flash_job *job) {
+    sparse_chunk_header ch;
+    uint32_t data;
+
+    while (job->chunks) {
+        job->chunks--;
+        if (job_read(job, &ch, sizeof(ch)) != sizeof(ch) ||
+            job_skip(job, job->simg.chunk_hdr_sz - sizeof(ch)) ||
+            ch.total_sz < job->simg.chunk_hdr_sz)
+            return -1;
+        data = ch.total_sz - job->simg.chunk_hdr_sz;
+        job->left = (uint64_t)ch.chunk_sz * job->simg.blk_sz;
+        if (job->left >> 9 > job->end - job->offset) return -1;
+
+        switch (ch.chunk_type) {
+        case CHUNK_TYPE_RAW:
+            if (data != job->left) return -1;
+            break;
+        case CHUNK_TYPE_FILL:
+            if (data != 4 || job_read(job, &job->fill, 4) != 4) return -1;
+            break;
+        case CHUNK_TYPE_DONT_CARE:
+            job->skipped += job->left >> 9;
+            job->offset += job->left >> 9;
+            job->left = 0;
+            /* fall through */
+        case CHUNK_TYPE_CRC32:
+            if (job_skip(job, data)) return -1;
+            continue;
+        default:
+            return -1;
         }
+        job->type = ch.chunk_type;
+        if (job->left) return 1;
+    }
+    return 0;
+}
 
-        if (hdr.tag != 0x544F4F42 && hdr.tag != 0x2052444C) {
-            fatal("%s is not a valid packed bootloader (%s)\n", bootfile, hdr.tag); 
+/* reader stage of f for sparse images: RAW chunks are streamed as they
+ * are, 0xffffffff fills are erased and other fills are written out */
+static int read_simg(void *ctx, rkusb_slot *slot) {
+    flash_job *job = ctx;
+    uint32_t n, i;
+    int r;
+
+    for (;;) {
+        if (!job->left && (r = simg_chunk(job)) <= 0) {
+            if (r) info("corrupt sparse image at chunk %u\n",
+                        job->simg.total_chunks - job->chunks);
+            return r;
         }
-        entrys = (rk_boot_entry *) malloc(sizeof(rk_boot_entry) * (hdr.code471Num + hdr.code472Num + hdr.loaderNum));
-        memset(entrys, 0x00, sizeof(rk_boot_entry) * (hdr.code471Num + hdr.code472Num + hdr.loaderNum));
-        fread(entrys, (sizeof(rk_boot_entry) * (hdr.code471Num + hdr.code472Num + hdr.loaderNum)), 1, fp);
 
-        for (int i = 0; i < (hdr.code471Num + hdr.code472Num + hdr.loaderNum); i++) {
-            fseek(fp, entrys[i].dataOffset, SEEK_SET);
-            rkboot_wide2str(entrys[i].name, name, MAX_NAME_LEN);
-            if (entrys[i].type == ENTRY_471) {
-                boot_data.ddrbin = malloc(entrys[i].dataSize);
-                boot_data.ddrbin_size = entrys[i].dataSize;
-                fread(boot_data.ddrbin, 1, entrys[i].dataSize, fp);
-                rkrc4(boot_data.ddrbin, entrys[i].dataSize);
-            }
-            if (entrys[i].type == ENTRY_472) {
-                boot_data.usbplug = malloc(entrys[i].dataSize);
-                boot_data.usbplug_size = entrys[i].dataSize;
-                fread(boot_data.usbplug, 1, entrys[i].dataSize, fp);
-                rkrc4(boot_data.usbplug, entrys[i].dataSize);
-            }
-            if (entrys[i].type == ENTRY_LOADER && !strcmp("FlashData", name) ) {
-                uint32_t x = 0;
-                boot_data.flashdata = malloc(entrys[i].dataSize);
-                boot_data.flashdata_size = entrys[i].dataSize;
-                memset(boot_data.flashdata, 0x00, boot_data.flashdata_size);
-                fread(boot_data.flashdata, 1, boot_data.flashdata_size, fp);
-                for (x = 0; x < boot_data.flashdata_size / 512; x++) {
-                    rkrc4(boot_data.flashdata + x * 512, 512);
-                }
-                if (boot_data.flashdata_size % 512) {
-                    rkrc4(boot_data.flashdata + x * 512, boot_data.flashdata_size % 512);
-                }
-            }
+        n = job->type == CHUNK_TYPE_FILL && job->fill == 0xffffffff ? RKFT_ERASE_INCR : job->incr;
+        if (n > job->left >> 9) n = job->left >> 9;
+        job->left -= n * 512;
 
-            if (entrys[i].type == ENTRY_LOADER && !strcmp("FlashBoot", name) ) {
-                uint32_t x = 0;
-                boot_data.flashboot = malloc(entrys[i].dataSize);
-                boot_data.flashboot_size = entrys[i].dataSize;
-                memset(boot_data.flashboot, 0x00, boot_data.flashboot_size);
-                fread(boot_data.flashboot, 1, entrys[i].dataSize, fp);
-                for (x = 0; x < boot_data.flashboot_size / 512; x++){
-                    rkrc4(boot_data.flashboot + x * 512, 512); 
-                }
-                if (boot_data.flashboot_size % 512) {
-                    rkrc4(boot_data.flashboot + x * 512, boot_data.flashboot_size % 512);
-                }
+        if (job->type == CHUNK_TYPE_RAW) {
+            if (job_read(job, slot->buf, n * 512) != n * 512) {
+                info("unexpected end of sparse image\n");
+                return -1;
             }
+        } else if (job->fill == 0xffffffff) {
+            rkusb_slot_cmd(slot, RKFT_CMD_ERASE_LBA, job->offset, n);
+            job->offset += n;
+            job->erased += n;
+            return 1;
+        } else if (!job->fill && job->blank) {
+            job->offset += n;
+            job->skipped += n;
+            continue;
+        } else {
+            for (i = 0; i < n * 512; i += 4)
+                memcpy(slot->buf + i, &job->fill, 4);
         }
-        fclose(fp);
+        rkusb_slot_cmd(slot, RKFT_CMD_WRITELBA, job->offset, n);
+        job->offset += n;
+        job->written += n;
+        return 1;
+    }
+}
+
+/* reader stage of f --resume: chains a hash of every chunk the real reader
+ * makes, and drops those below the journal mark once the hash there matches */
+static int read_resume(void *ctx, rkusb_slot *slot) {
+    flash_job *job = ctx;
+    uint32_t head[3], end = 0;
+    int r;
+
+    while ((r = job->read(ctx, slot)) > 0) {
+        head[0] = slot->command;
+        head[1] = slot->offset;
+        head[2] = slot->nsectors;
+        job->hash = rkcrc32(job->hash, (uint8_t *)head, sizeof(head));
+        if (slot->command == RKFT_CMD_WRITELBA)
+            job->hash = rkcrc32(job->hash, slot->buf, slot->nsectors * 512);
+        else if (slot->command == RKFT_CMD_READLBA)
+            job->hash = rkcrc32(job->hash, (uint8_t *)&slot->crc, 4);
+        end = slot->offset + slot->nsectors;
+        if (!job->replay) break;
+
+        if (end > job->j->resume) break;
+        if (slot->command == RKFT_CMD_WRITELBA) job->written -= slot->nsectors;
+        if (slot->command == RKFT_CMD_ERASE_LBA) job->erased -= slot->nsectors;
+        job->resumed += slot->nsectors;
+        rkprogress_at(end);
+        if (end == job->j->resume) {
+            if (job->hash != job->j->rhash) break;
+            job->replay = 0;
+        }
+    }
+    if (r >= 0 && job->replay) {
+        info("the image does not match %s\n", job->j->name);
+        return -1;
+    }
+    if (r <= 0) return r;
+    if (rkjournal_push(job->j, slot->offset, end, job->hash)) return -1;
+    return 1;
+}
+
+static int flash_chunk(void *ctx, rkusb_slot *slot) {
+    flash_job *job = ctx;
+
+    if (slot->error) {
+        if (slot->error < 0 || slot->command != RKFT_CMD_ERASE_LBA) return -1;
+        /* old loader: these get 0xff writes once the pipe is done */
+        return add_range(&job->failed, slot->offset, slot->nsectors) ? -1 : 1;
+    }
+    if (slot->command == RKFT_CMD_READLBA && slot->tries) {
+        return verify_slot(&job->v, slot);
+    }
+    if (slot->command == RKFT_CMD_READLBA) {
+        /* -D: only send the chunk if the device holds something else */
+        if (rkcrc32(0, slot->buf, slot->length) == slot->crc) {
+            rkprogress_at(slot->offset + slot->nsectors);
+            job->unchanged += slot->nsectors;
+            return 1;
+        }
+        rkusb_slot_swap(slot);
+        rkusb_slot_cmd(slot, RKFT_CMD_WRITELBA, slot->offset, slot->nsectors);
+        job->written += slot->nsectors;
+        return RKUSB_STAGE_AGAIN;
+    }
+    rkprogress_at(slot->offset + slot->nsectors);
+    return slot->command == RKFT_CMD_WRITELBA ? verify_slot(&job->v, slot) : 1;
+}
+
+/* consumer of f --resume: chunks that went through cleanly are done, those
+ * that were rejected or read back wrong hold the mark where it is */
+static int flash_resume(void *ctx, rkusb_slot *slot) {
+    flash_job *job = ctx;
+    uint32_t bad = job->failed.n + job->v.bad.n;
+    int r = flash_chunk(ctx, slot);
+
+    if (r == 1 && job->failed.n + job->v.bad.n == bad && rkjournal_done(job->j, slot->offset)) {
+        info("cannot write %s: %s\n", job->j->name, strerror(errno));
+        return -1;
     }
+    return r;
+}
+
+typedef struct {
+    uint32_t command, offset, end, incr;
+    const char *what;
+} erase_job;
+
+/* erase in large ERASE_LBA batches, or with 0xff writes for old loaders */
+static int erase_next(void *ctx, rkusb_slot *slot) {
+    erase_job *job = ctx;
+    uint32_t n = job->end - job->offset;
+
+    if (n > job->incr) n = job->incr;
+    if (!n) return 0;
+
+    if (job->command == RKFT_CMD_WRITELBA)
+        memset(slot->buf, 0xff, n * 512);
+    rkusb_slot_cmd(slot, job->command, job->offset, n);
+    job->offset += n;
+    return 1;
+}
+
+static int erase_chunk(void *ctx, rkusb_slot *slot) {
+    (void)ctx;
+    if (slot->error) return -1;
+    rkprogress_at(slot->offset + slot->nsectors);
+    return 1;
+}
+
+typedef struct {
+    uint8_t *data;
+    uint32_t size, offset, incr;        /* data is size sectors long */
+    uint32_t stride, copies;            /* written at offset + n * stride */
+    uint32_t done, copy;
+    const char *what;
+    verify_state v;
+} mem_job;
+
+/* writes a buffer in memory, possibly several times, for a and P */
+static int write_mem(void *ctx, rkusb_slot *slot) {
+    mem_job *job = ctx;
+    uint32_t n = job->size - job->done;
+
+    if (!n) {
+        if (++job->copy >= job->copies) return 0;
+        job->done = 0;
+        n = job->size;
+    }
+    if (n > job->incr) n = job->incr;
+    memcpy(slot->buf, job->data + job->done * 512, n * 512);
+    rkusb_slot_cmd(slot, RKFT_CMD_WRITELBA, job->offset + job->copy * job->stride + job->done, n);
+    job->done += n;
+    return 1;
+}
+
+static int mem_chunk(void *ctx, rkusb_slot *slot) {
+    mem_job *job = ctx;
+
+    if (slot->error) return -1;
+    if (slot->command == RKFT_CMD_WRITELBA)
+        rkprogress_add(slot->nsectors);
+    return verify_slot(&job->v, slot);
+}
+
+/* everything taken from the command line and the input files, shared by
+ * all devices */
+typedef struct {
+    char action;
+    long offset, size;
+    uint8_t flag, wipe;
+    char *partname, *ifile;
+    rk_boot_data boot_data;
+    uint8_t param[RKFT_RKPARAM_BLOCKSIZE];  /* P: parameter block to write */
+    int has_param;                          /* F: param holds a block */
+    char **parts;                           /* F: partname, file pairs */
+    int nparts;
+    int depth, tune, blank, diff;
+    uint32_t blocksize;
+    const char *compress;
+    verify_state verify;
+    const char *journal;                    /* --resume */
+    int stats;                              /* --stats: 1 table, 2 json */
+} rkft_plan;
+
+#define NEXT do { argc--;argv++; } while(0)
 
-    /* Initialize libusb */
-    if ( !(di = rkusb_connect_device()) ) fatal("cannot open device\n");
+/* runs the plan on one connected device; 0 on success */
+static int run_plan(const rkft_plan *plan, rkusb_device *di) {
+    FILE *fp = NULL;
+    long offset = plan->offset, size = plan->size, isize = 0;
+    uint8_t flag = plan->flag, wipe = plan->wipe, *tmpBuf = NULL;
+    char action = plan->action, *partname = plan->partname, *ifile = plan->ifile;
+    nand_info *nand = NULL;
+    rk_boot_data boot_data = plan->boot_data;
+    rkidb *idbheader;
+    int depth = plan->depth, tune = plan->tune, blank = plan->blank, diff = plan->diff, ret = 0;
+    const char *compress = plan->compress;
+    verify_state verify = plan->verify;
+    uint32_t blocksize = plan->blocksize, incr;
 
     if (di->mode == RKFT_USB_MODE_MASKROM) {
         info("detected %s in MASKROM mode\n", di->soc);
@@ -237,18 +821,21 @@ int main(int argc, char **argv) {
     if ( action != 'b' ) {
         if (di->mode == RKFT_USB_MODE_LOADER) {
             info("reset device in MASKROM mode!\n");
+            ret = 1;
             goto exit;
         }
     }
 
     switch(action) {
         case 'l':
-            size = rkusb_prepare_vendor_code(&tmpBuf, boot_data.ddrbin, boot_data.ddrbin_size);
+            tmpBuf = malloc(rkusb_vendor_code_size(boot_data.ddrbin_size));
+            size = rkusb_prepare_vendor_code(tmpBuf, boot_data.ddrbin, boot_data.ddrbin_size);
             info("send ddrbin vendor code\n");
             rkusb_send_vendor_code(di, tmpBuf, size, 0x471);
             free(tmpBuf);
 
-            size = rkusb_prepare_vendor_code(&tmpBuf, boot_data.usbplug, boot_data.usbplug_size);
+            tmpBuf = malloc(rkusb_vendor_code_size(boot_data.usbplug_size));
+            size = rkusb_prepare_vendor_code(tmpBuf, boot_data.usbplug, boot_data.usbplug_size);
             info("send usbplug vendor code\n");
             rkusb_send_vendor_code(di, tmpBuf, size, 0x472);
             free(tmpBuf);
@@ -257,9 +844,8 @@ int main(int argc, char **argv) {
     }
 
     /* Initialize bootloader interface */
-    rkusb_send_cmd(di, RKFT_CMD_TESTUNITREADY, 0, 0);
-    rkusb_recv_res(di);
-    usleep(20*1000);
+    if (rkusb_wait_ready(di, RKFT_READY_TIMEOUT))
+        info("device not ready, trying anyway\n");
 
     if ( action != 'b' && action != 'l' ) {
         rkusb_send_cmd(di, RKFT_CMD_READFLASHID, 0, 0);
@@ -270,6 +856,7 @@ int main(int argc, char **argv) {
             && di->buf[3] == 0x0 && di->buf[4] == 0x0 ) {
             info("internal storage seems not probed, maybe your device is in maskrom mode.\n");
 	    info("please load usbplug!\n");
+            ret = 1;
             goto exit;
         }
 
@@ -279,7 +866,20 @@ int main(int argc, char **argv) {
         rkusb_recv_buf(di, 512);
         rkusb_recv_res(di);
         memcpy(nand, di->buf, sizeof(nand_info));
+
+        if (tune && !(blocksize = tune_cache_get(di->pid))) {
+            info("probing transfer sizes...\n");
+            double rates[RKUSB_TUNE_SIZES];
+            blocksize = rkusb_pipe_tune(di, depth, nand->flash_size < 0x4000 ? nand->flash_size : 0x4000, rates);
+            for (int i = 0; rkusb_tune_sizes[i] && rates[i]; i++)
+                info("transfer size 0x%06x: %.1f MB/s\n", rkusb_tune_sizes[i], rates[i] / 1e6);
+            tune_cache_put(di->pid, blocksize);
+        }
+        if (rkusb_set_blocksize(di, blocksize))
+            fatal("cannot use transfer size %#x\n", blocksize);
+        if (tune) info("using transfer size %#x\n", blocksize);
     }
+    incr = di->blocksize >> 9;
 
     /* Parse partition name */
     if (partname) {        
@@ -308,45 +908,37 @@ int main(int argc, char **argv) {
         size = *p;
         if (size < 0 || size > MAX_PARAM_LENGTH) {
             info("Bad parameter length!\n");
+            ret = 1;
             goto exit;
         }
 
-        /* Search for mtdparts */
+        /* Look up the partition in mtdparts */
         const char *param = (const char *)&di->buf[8];
-        const char *mtdparts = strstr(param, "mtdparts=");
-        if (!mtdparts) {
+        uint32_t poff, psize;
+        di->buf[8 + size] = '\0';
+        switch (rkparam_find(param, partname, &poff, &psize)) {
+        case RKPARAM_NO_MTDPARTS:
             info("Error: 'mtdparts' not found in command line.\n");
+            ret = 1;
             goto exit;
-        }
-
-        /* Search for '(partition_name)' */
-        char partexp[256];
-        snprintf(partexp, 256, "(%s)", partname);
-        char *par = strstr(mtdparts, partexp);
-        if (!par) {
+        case RKPARAM_NO_PARTITION:
             info("Error: Partition '%s' not found.\n", partname);
+            ret = 1;
             goto exit;
-        }
-
-        /* Cut string by NULL-ing just before (partition_name) */
-        par[0] = '\0';
-
-        /* Search for '@' sign */
-        char *arob = strrchr(mtdparts, '@');
-        if (!arob) {
+        case RKPARAM_BAD_OFFSET:
             info("Error: Bad syntax in mtdparts.\n");
+            ret = 1;
+            goto exit;
+        case RKPARAM_BAD_SIZE:
+            info("Error: Bad syntax for partition size.\n");
+            ret = 1;
             goto exit;
         }
 
-        offset = strtoul(arob+1, NULL, 0) + 0x2000; // skip bootloader sectors
+        offset = poff + 0x2000; // skip bootloader sectors
         info("found offset: %#010x\n", offset);
 
-        /* Cut string by NULL-ing just before '@' sign */
-        arob[0] = '\0';
-
-        /* Search for '-' sign (if last partition) */
-        char *minus = strrchr(mtdparts, '-');
-        if (minus) {
+        if (psize == RKPARAM_TO_END) {
 
             /* Read size from NAND info */
             rkusb_send_cmd(di, RKFT_CMD_READFLASHINFO, 0, 0);
@@ -357,31 +949,12 @@ int main(int argc, char **argv) {
             size = nand->flash_size - offset;
 
             info("partition extends up to the end of NAND (size: 0x%08x).\n", size);
-            goto action;
+        } else {
+            size = psize;
+            info("found size: %#010x\n", size);
         }
-
-        /* Search for ',' sign */
-        char *comma = strrchr(mtdparts, ',');
-        if (comma) {
-            size = strtoul(comma+1, NULL, 0);
-            info("found size: %#010x\n", size);
-            goto action;
-        }
-
-        /* Search for ':' sign (if first partition) */
-        char *colon = strrchr(mtdparts, ':');
-        if (colon) {
-            size = strtoul(colon+1, NULL, 0);
-            info("found size: %#010x\n", size);
-            goto action;
-        }
-
-        /* Error: size not found! */
-        info("Error: Bad syntax for partition size.\n");
-        goto exit;
     }
 
-action:
     /* Check and execute command */
 
     switch(action) {
@@ -405,23 +978,18 @@ action:
             // copy miniloader
             memcpy( ((unsigned char*)idbheader) + 2048 + boot_data.flashdata_size, boot_data.flashboot, boot_data.flashboot_size);
 
-            while (size >= RKFT_OFF_INCR) {
-                infocr("writing idbloader at offset 0x%08x", 0x40 + offset);
-                memcpy( di->buf, ((unsigned char*)idbheader) + (offset * 512), RKFT_BLOCKSIZE);
-                rkusb_send_cmd(di, RKFT_CMD_WRITELBA, 0x40 + offset, RKFT_OFF_INCR);
-                rkusb_send_buf(di, RKFT_BLOCKSIZE);
-                rkusb_recv_res(di);
-
-                offset += RKFT_OFF_INCR;
-                size   -= RKFT_OFF_INCR;
-            }
-            if (size) {
-                memcpy( di->buf, ((unsigned char*)idbheader) + (offset * 512), size * 512);
-                rkusb_send_cmd(di, RKFT_CMD_WRITELBA, 0x40 + offset, size);
-                rkusb_send_buf(di, size * 512);
-                rkusb_recv_res(di);
+            {
+                mem_job job = { (uint8_t *)idbheader, size, 0x40, incr, 0, 1, 0, 0,
+                                "idbloader", verify };
+
+                rkprogress_begin(di->path, "writing idbloader", 0, size);
+                if (rkusb_pipe_exec(di, depth, write_mem, mem_chunk, &job))
+                    fatal("Write error!\n");
+                rkprogress_end();
+                info("... Done\n");
+                if (verify_report(&job.v))
+                    fatal("Verify failed!\n");
             }
-            info("... Done\n");
             break;
         case 'b':   /* Reboot device */
             info("rebooting device...\n");
@@ -430,102 +998,140 @@ action:
             break;
         case 'd':   /* Read FLASH */
             size = nand->flash_size; /* Flash size in sectors*/
-            while (size >= RKFT_OFF_INCR) {
-                infocr("reading flash memory at offset 0x%08x", offset);
-
-                rkusb_send_cmd(di, RKFT_CMD_READLBA, offset, RKFT_OFF_INCR);
-                rkusb_recv_buf(di, RKFT_BLOCKSIZE);
-                rkusb_recv_res(di);
-
-                if (write(1, di->buf, RKFT_BLOCKSIZE) <= 0)
-                    fatal("Write error! Disk full?\n");
-
-                offset += RKFT_OFF_INCR;
-                size   -= RKFT_OFF_INCR;
-            }
-            if (size) {
-                rkusb_send_cmd(di, RKFT_CMD_READLBA, offset, size);
-                rkusb_recv_buf(di, size * 512);
-                rkusb_recv_res(di);
-
-                if (write(1, di->buf, size * 512) <= 0)
-                    fatal("Write error! Disk full?\n");
-            }
-            info("... Done!\n");
-            break;
+            /* fall through */
         case 'r':   /* Read FLASH */
-            while (size >= RKFT_OFF_INCR) {
-                infocr("reading flash memory at offset 0x%08x", offset);
-
-                rkusb_send_cmd(di, RKFT_CMD_READLBA, offset, RKFT_OFF_INCR);
-                rkusb_recv_buf(di, RKFT_BLOCKSIZE);
-                rkusb_recv_res(di);
-
-                if (write(1, di->buf, RKFT_BLOCKSIZE) <= 0)
-                    fatal("Write error! Disk full?\n");
-
-                offset += RKFT_OFF_INCR;
-                size   -= RKFT_OFF_INCR;
-            }
-            if (size) {
-                rkusb_send_cmd(di, RKFT_CMD_READLBA, offset, size);
-                rkusb_recv_buf(di, size * 512);
-                rkusb_recv_res(di);
+            {
+                dump_job job = { .fd = 1, .sparse = dump_sparse(1) };
+                rkjournal journal;
 
-                if (write(1, di->buf, size * 512) <= 0)
-                    fatal("Write error! Disk full?\n");
+                if (plan->journal) {
+                    uint32_t at;
 
+                    job.j = &journal;
+                    at = dump_resume(plan->journal, di, nand, offset, size, incr, &job);
+                    size -= at - offset;
+                    offset = at;
+                }
+                if (compress) {
+                    /* the compressor writes to our stdout */
+                    if (!(fp = popen(compress, "w")))
+                        fatal("unable to run %s\n", compress);
+                    job.fd = fileno(fp);
+                    job.sparse = 0;
+                }
+                rkprogress_begin(di->path, "reading", offset, offset + size);
+                if (rkusb_pipe_read(di, depth, offset, size, write_chunk, &job)) {
+                    if (job.j) rkjournal_close(job.j, 0);
+                    fatal("Read error!\n");
+                }
+                rkprogress_end();
+                if (compress && pclose(fp))
+                    fatal("%s failed\n", compress);
+                info("... Done!\n");
+                if (job.sparse)
+                    dump_finish(&job);
+                if (job.j && rkjournal_close(job.j, 1))
+                    fatal("cannot remove %s: %s\n", plan->journal, strerror(errno));
             }
-            info("... Done!\n");
             break;
         case 'f':   /* Write FLASH */
-	    int eof = 1;
-            fp = fopen(ifile , "rb");
-            isize = rkusb_file_size(fp) >> 9;
-            if ( isize > size ) {
-                fatal("File too big!!\n");
-            }
-
-            while (size >= RKFT_OFF_INCR) {
-                infocr("writing flash memory at offset 0x%08x", offset);
-		memset(di->buf, 0 , RKFT_BLOCKSIZE);
-		
-		if (eof) {
-		    eof = fread(di->buf, RKFT_BLOCKSIZE, 1 , fp);
-		    if ( eof <= 0) {			
-			if (!partname) {
-			    info("... Done!\n");
-			    info("premature end-of-file reached.\n");
-			    goto exit;
-			}		                        
-		    }
-		}
-
-                rkusb_send_cmd(di, RKFT_CMD_WRITELBA, offset, RKFT_OFF_INCR);
-                rkusb_send_buf(di, RKFT_BLOCKSIZE);
-                rkusb_recv_res(di);
+            {
+                flash_job job = { .offset = offset, .end = offset + size, .incr = incr,
+                                  .pad = partname != NULL, .v = verify };
+                rkjournal journal;
+                uint32_t i;
+
+                if (!partname) job.end = nand->flash_size;
+                if (!(job.fp = open_image(ifile, &job.piped)))
+                    fatal("unable to open %s file\n", ifile);
+                /* the size of a compressed image is only known at its end */
+                isize = job.piped ? 0 : (rkusb_file_size(job.fp) + 511) >> 9;
+                job.nhead = fread(job.head, 1, sizeof(job.head), job.fp);
+                memcpy(&job.simg, job.head, sizeof(job.simg));
+                if (job.nhead == sizeof(job.head) && job.simg.magic == SPARSE_HEADER_MAGIC) {
+                    job.hpos = job.nhead;
+                    if (job.simg.major_version != SPARSE_MAJOR_VERSION ||
+                        job.simg.file_hdr_sz < sizeof(sparse_header) ||
+                        job.simg.chunk_hdr_sz < sizeof(sparse_chunk_header) ||
+                        !job.simg.blk_sz || job.simg.blk_sz % 512 ||
+                        job_skip(&job, job.simg.file_hdr_sz - sizeof(sparse_header)))
+                        fatal("unsupported sparse image %s\n", ifile);
+                    info("sparse image: %u blocks of %u bytes in %u chunks\n",
+                         job.simg.total_blks, job.simg.blk_sz, job.simg.total_chunks);
+                    job.chunks = job.simg.total_chunks;
+                    isize = (uint64_t)job.simg.total_blks * job.simg.blk_sz >> 9;
+                } else {
+                    job.simg.magic = 0;
+                }
+                if ( isize > job.end - job.offset ) {
+                    fatal("File too big!!\n");
+                }
 
-                offset += RKFT_OFF_INCR;
-                size   -= RKFT_OFF_INCR;
-            }
-            if (size) {
-	        memset(di->buf, 0 , RKFT_BLOCKSIZE);
-	        if (eof) {
-			eof = fread(di->buf, size * 512, 1 , fp);
-			if ( eof <= 0) {			    
-			    if (!partname) {
-				info("... Done!\n");
-				info("premature end-of-file reached.\n");
-				goto exit;
-			    }
-			}
-		}
-                rkusb_send_cmd(di, RKFT_CMD_WRITELBA, offset, size);
-                rkusb_send_buf(di, size * 512);
-                rkusb_recv_res(di);
+                job.blank = blank;
+                if (blank && !diff && !job.chunks) {
+                    job.grain = incr < RKFT_BLANK_GRAIN ? incr : RKFT_BLANK_GRAIN;
+                    if (!(job.look = rkusb_buf_alloc(job.grain * 512)))
+                        fatal("out of memory\n");
+                }
+                job.read = job.simg.magic ? read_simg : diff ? read_diff :
+                           blank ? read_sparse : read_chunk;
+                if (plan->journal) {
+                    char key[128];
+
+                    snprintf(key, sizeof(key), "rkflashtool f %x %x %x %s %04x %08x",
+                             job.offset, job.end, incr,
+                             job.simg.magic ? "simg" : diff ? "diff" : blank ? "blank" : "raw",
+                             di->pid, rkcrc32(0, (uint8_t *)nand, sizeof(*nand)));
+                    if (rkjournal_open(&journal, plan->journal, key, job.offset)) {
+                        if (!errno) fatal("%s is the journal of another transfer\n", plan->journal);
+                        fatal("cannot open %s: %s\n", plan->journal, strerror(errno));
+                    }
+                    job.j = &journal;
+                    job.replay = journal.resume > job.offset;
+                    if (job.replay)
+                        info("resuming at 0x%08x\n", journal.resume);
+                }
+                /* a compressed image may end anywhere before job.end */
+                rkprogress_begin(di->path, "writing", job.offset,
+                                 isize ? job.offset + isize : job.end);
+                if (rkusb_pipe_exec(di, depth, job.j ? read_resume : job.read,
+                                    job.j ? flash_resume : flash_chunk, &job)) {
+                    if (job.j) rkjournal_close(job.j, 0);
+                    fatal("Write error!\n");
+                }
+                rkprogress_end();
+                for (i = 0; i < job.failed.n; i++) {
+                    erase_job fill = { RKFT_CMD_WRITELBA, job.failed.r[i][0], job.failed.r[i][1],
+                                       incr, "filling" };
+                    if (!i) info("loader rejected ERASE_LBA, filling with 0xff\n");
+                    rkprogress_begin(di->path, fill.what, fill.offset, fill.end);
+                    if (rkusb_pipe_exec(di, depth, erase_next, erase_chunk, &fill))
+                        fatal("Write error!\n");
+                    rkprogress_end();
+                }
+                info("... Done!\n");
+                if (job.resumed)
+                    info("%u sectors done by an earlier run\n", job.resumed);
+                if (diff && !job.simg.magic)
+                    info("%u sectors written, %u unchanged\n", job.written, job.unchanged);
+                else if (blank || job.simg.magic)
+                    info("%u sectors written, %u erased, %u skipped\n",
+                         job.written, job.erased, job.skipped);
+                if (!partname && !job.simg.magic && job.offset < job.end)
+                    info("premature end-of-file reached.\n");
+                if (job.piped && !job.simg.magic && !job.eof && fgetc(job.fp) != EOF)
+                    fatal("File too big!!\n");
+                rkusb_buf_free(job.look);
+                free(job.failed.r);
+                if (job.piped ? pclose(job.fp) : fclose(job.fp))
+                    fatal("%s: decompression failed\n", ifile);
+                if (verify_report(&job.v)) {
+                    if (job.j) rkjournal_close(job.j, 0);
+                    fatal("Verify failed!\n");
+                }
+                if (job.j && rkjournal_close(job.j, 1))
+                    fatal("cannot remove %s: %s\n", plan->journal, strerror(errno));
             }
-            info("... Done!\n");
-            fclose(fp);
             break;
         /*case 'w':  Write FLASH 
 	    fp = fopen(ifile , "rb");
@@ -606,77 +1212,42 @@ action:
             break;
         case 'P':   /* Write parameters */
             {
-		/* clean buffer */
-		memset(di->buf, 0 , RKFT_RKPARAM_BLOCKSIZE);
-                /* Header */
-                memcpy((char *)di->buf, "PARM", 4);
-
-                /* Content */
-                int sizeRead;
-                if ((sizeRead = read(0, di->buf + 8, RKFT_RKPARAM_BLOCKSIZE - 8)) < 0) {
-                    info("read error: %s\n", strerror(errno));
-                    goto exit;
-                }
-
-                /* Length */
-                *(uint32_t *)(di->buf + 4) = sizeRead;
-
-                /* CRC */
-                uint32_t crc = 0;
-                crc = rkcrc32(crc, di->buf + 8, sizeRead);
-                PUT32LE(di->buf + 8 + sizeRead, crc);
-
-                /*
-                 * The parameter file is written at 8 different offsets:
-                 * 0x0000, 0x0400, 0x0800, 0x0C00, 0x1000, 0x1400, 0x1800, 0x1C00
-                 */
-
-                for(offset = 0x0; offset <= 0x2000; offset += 0x400) {
-                    infocr("writing flash memory at offset 0x%08x", offset);
-                    rkusb_send_cmd(di, RKFT_CMD_WRITELBA, offset, RKFT_RKPARAM_BLOCKSIZE >> 9);
-                    rkusb_send_buf(di, RKFT_RKPARAM_BLOCKSIZE);
-                    rkusb_recv_res(di);
-                }
+                mem_job job = { (uint8_t *)plan->param, RKFT_RKPARAM_BLOCKSIZE >> 9, 0, incr, 0x400, 0x2000 / 0x400 + 1,
+                                0, 0, "parameters", verify };
+
+                rkprogress_begin(di->path, "writing parameters", 0, job.size * job.copies);
+                if (rkusb_pipe_exec(di, depth, write_mem, mem_chunk, &job))
+                    fatal("Write error!\n");
+                rkprogress_end();
+                info("... Done!\n");
+                if (verify_report(&job.v))
+                    fatal("Verify failed!\n");
             }
-            info("... Done!\n");
             break;
         case 'e':   /* Erase flash */
-            if ( !wipe) {
-                memset(di->buf, 0xff, RKFT_BLOCKSIZE);
-                while ( size >= RKFT_OFF_INCR ) {
-                    infocr("erasing flash memory at offset 0x%08x", offset);
-
-                    rkusb_send_cmd(di, RKFT_CMD_WRITELBA, offset, RKFT_OFF_INCR);
-                    rkusb_send_buf(di, RKFT_BLOCKSIZE);
-                    rkusb_recv_res(di);
-
-                    offset += RKFT_OFF_INCR;
-                    size   -= RKFT_OFF_INCR;
-                }
-                if (size) {
-                    rkusb_send_cmd(di, RKFT_CMD_WRITELBA, offset, size);
-                    rkusb_send_buf(di, size * 512);
-                    rkusb_recv_res(di);
-                }
-            } else {
-                size = nand->flash_size;
-                memset(di->buf, 0xff, RKFT_BLOCKSIZE);
-                while ( size >= RKFT_OFF_INCR ) {
-                    infocr("wiping flash memory at offset 0x%08x", offset);
-                    rkusb_send_cmd(di, RKFT_CMD_WRITELBA, offset, RKFT_OFF_INCR);
-                    rkusb_send_buf(di, RKFT_BLOCKSIZE);
-                    rkusb_recv_res(di);
-
-                    offset += RKFT_OFF_INCR;
-                    size   -= RKFT_OFF_INCR;
-                }
-                if (size) {
-                    rkusb_send_cmd(di, RKFT_CMD_WRITELBA, offset, size);
-                    rkusb_send_buf(di, size * 512);
-                    rkusb_recv_res(di);
+            {
+                erase_job job = { RKFT_CMD_ERASE_LBA, offset, offset + size, RKFT_ERASE_INCR,
+                                  wipe ? "wiping" : "erasing" };
+
+                uint32_t n;
+
+                if (wipe) job.end = nand->flash_size;
+                rkprogress_begin(di->path, job.what, job.offset, job.end);
+                if ((n = job.end - job.offset) > job.incr) n = job.incr;
+                if (n) {
+                    /* the first batch tells whether the loader erases natively */
+                    if (!rkusb_erase_lba(di, job.offset, n)) {
+                        job.offset += n;
+                        rkprogress_at(job.offset);
+                    } else {
+                        info("loader rejected ERASE_LBA, filling with 0xff\n");
+                        job.command = RKFT_CMD_WRITELBA;
+                        job.incr = incr;
+                    }
                 }
-
-                infocr("wiping flash memory at offset 0x%08x\n", offset);
+                if (rkusb_pipe_exec(di, depth, erase_next, erase_chunk, &job))
+                    fatal("Erase error!\n");
+                rkprogress_end();
             }
             info("Done!\n");
             break;
@@ -735,9 +1306,558 @@ action:
     }
 
 exit:
-    /* Disconnect and close all interfaces */
     free(nand);
+    return ret;
+}
+
+/*
+ * F: loads the usbplug unless the storage is already reachable, waits for
+ * the device to come back at the same USB path and then installs the
+ * bootloader, the parameters and the partitions in one go.
+ */
+static int run_provision(const rkft_plan *plan, rkusb_device **pdi) {
+    rkft_plan step = *plan;
+    rkusb_device *di = *pdi;
+    char path[RKUSB_PATH_MAX];
+    rkstats_entry stats[RKUSB_STATS_TYPES];
+    uint64_t nbytes;
+    int i, ret;
+
+    if (di->mode != RKFT_USB_MODE_MASKROM) {
+        info("reset device in MASKROM mode!\n");
+        return 1;
+    }
+    rkusb_wait_ready(di, RKFT_READY_TIMEOUT);
+    if (!rkusb_flash_probed(di)) {
+        step.action = 'l';
+        if ((ret = run_plan(&step, di)))
+            return ret;
+        strcpy(path, di->path);
+        nbytes = di->nbytes;
+        rkusb_sync_done(di);
+        memcpy(stats, di->stats, sizeof(stats));
+        rkusb_disconnect(di);
+        *pdi = NULL;
+        info("waiting for usbplug...\n");
+        if (!(di = *pdi = rkusb_reconnect(path, RKFT_REENUM_TIMEOUT))) {
+            info("device did not come back\n");
+            return 1;
+        }
+        di->nbytes = nbytes;
+        memcpy(di->stats, stats, sizeof(stats));
+    }
+
+    step.action = 'a';
+    if ((ret = run_plan(&step, di)))
+        return ret;
+    if (plan->has_param) {
+        step.action = 'P';
+        if ((ret = run_plan(&step, di)))
+            return ret;
+    }
+    for (i = 0; i < plan->nparts; i++) {
+        step.action = 'f';
+        step.partname = plan->parts[2 * i];
+        step.ifile = plan->parts[2 * i + 1];
+        if ((ret = run_plan(&step, di)))
+            return ret;
+    }
+    return 0;
+}
+
+/* --stats: the device of this process, reported at exit even after fatal() */
+static rkusb_device **stats_device;
+static int stats_json;
+
+static void print_stats(void) {
+    char prefix[64];
+
+    snprintf(prefix, sizeof(prefix), "%sinfo: ", info_prefix);
+    if (stats_device && *stats_device)
+        rkusb_print_stats(*stats_device, stderr, prefix, stats_json);
+    stats_device = NULL;
+}
+
+/* connects to the device at path (the first one found if NULL), runs the
+ * plan and adds what was transferred to *nbytes */
+static int run_path(const rkft_plan *plan, const char *path, uint64_t *nbytes) {
+    static int registered;
+    rkusb_device *di;
+    int ret;
+
+    if (!(di = rkusb_connect_path(path)))
+        fatal("cannot open device\n");
+    if (plan->stats) {
+        stats_device = &di;
+        stats_json = plan->stats == 2;
+        if (!registered++) atexit(print_stats);
+    }
+    if (plan->action == 'F')
+        ret = run_provision(plan, &di);
+    else
+        ret = run_plan(plan, di);
+    if (!di)
+        return ret;
+    if (nbytes)
+        *nbytes += di->nbytes;
+    print_stats();
+
+    /* Disconnect and close all interfaces */
     info("release rockusb device\r\n");
     rkusb_disconnect(di);
-    return 0;
+    return ret;
+}
+
+#ifndef _WIN32
+typedef struct {
+    char path[RKUSB_PATH_MAX];
+    pid_t pid;
+    int fd, status;
+    uint64_t nbytes;
+    double start, time;
+} rkft_worker;
+
+/* forks a process running the plan on the device at w->path */
+static void start_worker(const rkft_plan *plan, rkft_worker *w) {
+    static char prefix[RKUSB_PATH_MAX + 2];
+    uint64_t nbytes = 0;
+    int fds[2], st;
+
+    if (pipe(fds)) fatal("pipe: %s\n", strerror(errno));
+    w->start = rkstats_clock();
+    w->nbytes = 0;
+    w->status = -1;
+    fflush(NULL);
+    if ((w->pid = fork()) < 0) fatal("fork: %s\n", strerror(errno));
+    if (!w->pid) {
+        close(fds[0]);
+        snprintf(prefix, sizeof(prefix), "%s ", w->path);
+        info_prefix = prefix;
+        info_progress = 0;
+        st = run_path(plan, w->path, &nbytes);
+        if (write(fds[1], &nbytes, sizeof(nbytes)) < 0) st = 1;
+        exit(st);
+    }
+    close(fds[1]);
+    w->fd = fds[0];
+}
+
+/* collects one finished worker of the n, NULL if none (yet) */
+static rkft_worker *reap_worker(rkft_worker *w, int n, int block) {
+    pid_t pid;
+    int st, i;
+
+    while ((pid = waitpid(-1, &st, block ? 0 : WNOHANG)) > 0) {
+        for (i = 0; i < n && w[i].pid != pid; i++);
+        if (i == n) continue;
+        w[i].pid = 0;
+        w[i].time = rkstats_clock() - w[i].start;
+        w[i].status = WIFEXITED(st) ? WEXITSTATUS(st) : 128 + WTERMSIG(st);
+        if (read(w[i].fd, &w[i].nbytes, sizeof(w[i].nbytes)) != sizeof(w[i].nbytes))
+            w[i].nbytes = 0;
+        close(w[i].fd);
+        return &w[i];
+    }
+    return NULL;
+}
+
+static void report_worker(const rkft_worker *w) {
+    if (!w) {
+        info("%-16s %-6s %10s %8s %8s\n", "device", "status", "MiB", "seconds", "MiB/s");
+        return;
+    }
+    info("%-16s %-6s %10.1f %8.1f %8.1f\n", w->path, w->status ? "failed" : "ok",
+         w->nbytes / 1048576.0, w->time, w->nbytes / 1048576.0 / w->time);
+}
+#endif
+
+/*
+ * -m: the plan runs on every connected device at once, one worker process
+ * per device so a fatal error only ends its own device.  Inputs decoded
+ * beforehand (loader, parameters) are shared with the workers.
+ */
+static int run_all(const rkft_plan *plan, uint16_t mode) {
+#ifdef _WIN32
+    (void)plan; (void)mode;
+    fatal("-m is not supported on Windows\n");
+    return 1;
+#else
+    static char paths[RKFT_DEVICES_MAX][RKUSB_PATH_MAX];
+    static rkft_worker w[RKFT_DEVICES_MAX];
+    int n, i, failed = 0;
+
+    if ((n = rkusb_list_devices(paths, RKFT_DEVICES_MAX, mode)) <= 0)
+        fatal("cannot find any device\n");
+    info("found %d device%s\n", n, n > 1 ? "s" : "");
+
+    for (i = 0; i < n; i++) {
+        strcpy(w[i].path, paths[i]);
+        start_worker(plan, &w[i]);
+    }
+    while (reap_worker(w, n, 1));
+
+    report_worker(NULL);
+    for (i = 0; i < n; i++) {
+        if (w[i].status) failed++;
+        report_worker(&w[i]);
+    }
+    if (failed) info("%d of %d devices failed\n", failed, n);
+    return failed != 0;
+#endif
+}
+
+static int first_arrival(void *ctx, const char *path) {
+    strcpy(ctx, path);
+    return 1;
+}
+
+#ifndef _WIN32
+static int send_arrival(void *ctx, const char *path) {
+    char line[RKUSB_PATH_MAX + 1];
+    int len = snprintf(line, sizeof(line), "%s\n", path);
+
+    return write(*(int *)ctx, line, len) != len;
+}
+
+/*
+ * -w with -m: runs the plan on every device that arrives, for as long as
+ * it is interrupted.  Arrivals come from a watcher process, so no libusb
+ * state is ever inherited by the workers.
+ */
+static int run_station(const rkft_plan *plan, uint16_t mode) {
+    static rkft_worker w[RKFT_DEVICES_MAX];
+    char buf[RKFT_DEVICES_MAX * (RKUSB_PATH_MAX + 1)], *line, *nl;
+    int fds[2], i, len = 0;
+    size_t fill = 0;
+    ssize_t r;
+    struct timeval tv;
+    rkft_worker *done;
+    fd_set rd;
+
+    if (pipe(fds)) fatal("pipe: %s\n", strerror(errno));
+    fflush(NULL);
+    if (!fork()) {
+        close(fds[0]);
+        exit(rkusb_watch(mode, send_arrival, &fds[1]) ? 1 : 0);
+    }
+    close(fds[1]);
+    info("waiting for devices...\n");
+    report_worker(NULL);
+
+    for (;;) {
+        FD_ZERO(&rd);
+        FD_SET(fds[0], &rd);
+        tv.tv_sec = 0;
+        tv.tv_usec = 200 * 1000;
+        if (select(fds[0] + 1, &rd, NULL, NULL, &tv) > 0) {
+            if ((r = read(fds[0], buf + fill, sizeof(buf) - fill)) <= 0)
+                fatal("device watcher stopped\n");
+            fill += r;
+        }
+        /* one path per line */
+        for (line = buf; (nl = memchr(line, '\n', buf + fill - line)); line = nl + 1) {
+            *nl = 0;
+            if (strlen(line) >= RKUSB_PATH_MAX) continue;
+            /* a device that re-enumerates while its job runs is the same job */
+            for (i = 0; i < len && !(w[i].pid && !strcmp(w[i].path, line)); i++);
+            if (i == len) {
+                for (i = 0; i < len && w[i].pid; i++);
+                if (i == len && len == RKFT_DEVICES_MAX) {
+                    info("%s: too many devices at once, ignored\n", line);
+                    continue;
+                }
+                if (i == len) len++;
+                strcpy(w[i].path, line);
+                info("%s arrived\n", line);
+                start_worker(plan, &w[i]);
+            }
+        }
+        fill -= line - buf;
+        memmove(buf, line, fill);
+        while ((done = reap_worker(w, len, 0)))
+            report_worker(done);
+    }
+}
+#endif
+
+int main(int argc, char **argv) {
+    FILE *fp = NULL;
+    long offset = 0, size = 0;
+    uint8_t flag = 0, wipe = 0;
+    char action, name[ MAX_NAME_LEN + 1] , *partname = NULL, *ifile = NULL, *bootfile = NULL;
+    rk_boot_header hdr;
+    rk_boot_entry *entrys = NULL;
+    rk_boot_data boot_data = { .ddrbin = NULL,
+        .ddrbin_size = 0,
+        .usbplug = NULL,
+        .usbplug_size = 0,
+        .flashboot = NULL,
+        .flashboot_size = 0,
+        .flashdata = NULL,
+        .flashdata_size = 0
+    };
+    int ch, depth = RKFT_QUEUE_DEPTH, tune = 0, blank = 0, diff = 0, all = 0, wait = 0;
+    const char *compress = NULL, *path = NULL;
+    uint16_t mode = 0;
+    char arrived[RKUSB_PATH_MAX];
+    verify_state verify = { 0, 0, 0, 0, { NULL, 0 } };
+    uint32_t blocksize = RKFT_BLOCKSIZE;
+    char *end;
+    static rkft_plan plan;
+
+    static const struct option longopts[] = {
+        { "resume", required_argument, NULL, 'J' },
+        { "stats", optional_argument, NULL, 'S' },
+        { "progress", required_argument, NULL, 'G' },
+        { "progress-fd", required_argument, NULL, 'F' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    while ((ch = getopt_long(argc, argv, "+BDRVmq:s:u:w:z:", longopts, NULL)) != -1) {
+        switch (ch) {
+        case 'J': plan.journal = optarg; break;
+        case 'G':
+            if (!strcmp(optarg, "human")) progress.mode = RKPROGRESS_HUMAN;
+            else if (!strcmp(optarg, "json")) progress.mode = RKPROGRESS_JSON;
+            else if (!strcmp(optarg, "none")) progress.mode = RKPROGRESS_NONE;
+            else usage();
+            break;
+        case 'F':
+            progress.fd = strtol(optarg, &end, 10);
+            if (*end || progress.fd < 0) usage();
+            break;
+        case 'S':
+            if (!optarg || !strcmp(optarg, "table")) plan.stats = 1;
+            else if (!strcmp(optarg, "json")) plan.stats = 2;
+            else usage();
+            break;
+        case 'B': blank = 1; break;
+        case 'D': diff = 1; break;
+        case 'm': all = 1; break;
+        case 'u': path = optarg; break;
+        case 'w':
+            wait = 1;
+            if (!strcmp(optarg, "maskrom")) mode = RKFT_USB_MODE_MASKROM;
+            else if (!strcmp(optarg, "loader")) mode = RKFT_USB_MODE_LOADER;
+            else if (strcmp(optarg, "any")) usage();
+            break;
+        case 'R': verify.rewrite = 1; /* fall through */
+        case 'V': verify.verify = 1; break;
+        case 'q': depth = strtoul(optarg, NULL, 0); break;
+        case 's':
+            if (!strcmp(optarg, "auto")) {
+                tune = 1;
+                break;
+            }
+            {
+                unsigned long size = strtoul(optarg, &end, 0);
+                int shift = 0;
+
+                if (*end == 'k' || *end == 'K') shift = 10, end++;
+                else if (*end == 'm' || *end == 'M') shift = 20, end++;
+                /* checked before shifting, so that nothing wraps */
+                if (end == optarg || *end || size > (unsigned long)RKFT_BLOCKSIZE_MAX >> shift ||
+                    !(blocksize = size << shift) || blocksize % 512)
+                    fatal("transfer size must be a multiple of 512 up to %#x\n", RKFT_BLOCKSIZE_MAX);
+            }
+            break;
+        case 'z':
+            for (size_t i = 0; i < sizeof(compressors) / sizeof(compressors[0]); i++)
+                if (!strcmp(optarg, compressors[i].name))
+                    compress = compressors[i].cmd;
+            if (!compress)
+                fatal("unknown compressor %s\n", optarg);
+            break;
+        default: usage();
+        }
+    }
+    argc -= optind;
+    argv += optind;
+
+    if (!argc) usage();
+
+    action = **argv; NEXT;
+    
+    switch(action) {
+    case 'b':
+        if (argc > 1) usage();
+        else if (argc == 1)
+            flag = strtoul(argv[0], NULL, 0);
+        break;
+    case 'a':
+    case 'l':
+        if (argc != 1) usage();
+            bootfile = argv[0];
+        break;
+    case 'F':
+        if (argc < 1) usage();
+        bootfile = argv[0]; NEXT;
+        /* an odd count means a parameter file before the pairs */
+        if (argc % 2) {
+            ifile = argv[0]; NEXT;
+        }
+        plan.parts = argv;
+        plan.nparts = argc / 2;
+        break;
+    case 'f':
+        if (argc < 1 || argc > 2) usage();        
+	if (argc == 1) {
+            ifile = argv[0];
+	} else {
+	    partname = argv[0];
+	    ifile = argv[1];
+	}
+        break;
+    case 'e':
+        if (argc > 2) usage();
+        if (argc == 1) {
+            partname = argv[0];
+        } else if (argc == 2) {
+            offset = strtoul(argv[0], NULL, 0);
+            size   = strtoul(argv[1], NULL, 0);
+        } else {
+            wipe = 1;
+        }
+        break;
+    case 'r':
+    //case 'w':
+        if (argc < 1 || argc > 2) usage();
+        if (argc == 1) {
+            partname = argv[0];
+        } else {
+            offset = strtoul(argv[0], NULL, 0);
+            size   = strtoul(argv[1], NULL, 0);
+        }
+        break;
+    case 'n':
+    case 'v':
+    case 'p':
+    case 'P':
+    case 'd':
+        if (argc) usage();
+        offset = 0;
+        size   = 1024;
+        break;    
+    default:
+        usage();
+    }
+
+    if (bootfile) {
+
+        info ("loading bootloader file %s\n", bootfile);
+        fp = fopen(bootfile , "rb");
+        if (fp == NULL) {
+            fatal("unable to open %s file\n", bootfile); 
+        }
+
+        if ( !fread(&hdr, sizeof(rk_boot_header), 1, fp) ) {
+            fatal("unable to read %s file\n", bootfile); 
+        }
+
+        if (hdr.tag != 0x544F4F42 && hdr.tag != 0x2052444C) {
+            fatal("%s is not a valid packed bootloader (%s)\n", bootfile, hdr.tag); 
+        }
+        entrys = (rk_boot_entry *) malloc(sizeof(rk_boot_entry) * (hdr.code471Num + hdr.code472Num + hdr.loaderNum));
+        memset(entrys, 0x00, sizeof(rk_boot_entry) * (hdr.code471Num + hdr.code472Num + hdr.loaderNum));
+        fread(entrys, (sizeof(rk_boot_entry) * (hdr.code471Num + hdr.code472Num + hdr.loaderNum)), 1, fp);
+
+        for (int i = 0; i < (hdr.code471Num + hdr.code472Num + hdr.loaderNum); i++) {
+            fseek(fp, entrys[i].dataOffset, SEEK_SET);
+            rkboot_wide2str(entrys[i].name, name, MAX_NAME_LEN);
+            if (entrys[i].type == ENTRY_471) {
+                boot_data.ddrbin = malloc(entrys[i].dataSize);
+                boot_data.ddrbin_size = entrys[i].dataSize;
+                fread(boot_data.ddrbin, 1, entrys[i].dataSize, fp);
+                rkrc4(boot_data.ddrbin, entrys[i].dataSize);
+            }
+            if (entrys[i].type == ENTRY_472) {
+                boot_data.usbplug = malloc(entrys[i].dataSize);
+                boot_data.usbplug_size = entrys[i].dataSize;
+                fread(boot_data.usbplug, 1, entrys[i].dataSize, fp);
+                rkrc4(boot_data.usbplug, entrys[i].dataSize);
+            }
+            if (entrys[i].type == ENTRY_LOADER && !strcmp("FlashData", name) ) {
+                uint32_t x = 0;
+                boot_data.flashdata = malloc(entrys[i].dataSize);
+                boot_data.flashdata_size = entrys[i].dataSize;
+                memset(boot_data.flashdata, 0x00, boot_data.flashdata_size);
+                fread(boot_data.flashdata, 1, boot_data.flashdata_size, fp);
+                for (x = 0; x < boot_data.flashdata_size / 512; x++) {
+                    rkrc4(boot_data.flashdata + x * 512, 512);
+                }
+                if (boot_data.flashdata_size % 512) {
+                    rkrc4(boot_data.flashdata + x * 512, boot_data.flashdata_size % 512);
+                }
+            }
+
+            if (entrys[i].type == ENTRY_LOADER && !strcmp("FlashBoot", name) ) {
+                uint32_t x = 0;
+                boot_data.flashboot = malloc(entrys[i].dataSize);
+                boot_data.flashboot_size = entrys[i].dataSize;
+                memset(boot_data.flashboot, 0x00, boot_data.flashboot_size);
+                fread(boot_data.flashboot, 1, entrys[i].dataSize, fp);
+                for (x = 0; x < boot_data.flashboot_size / 512; x++){
+                    rkrc4(boot_data.flashboot + x * 512, 512); 
+                }
+                if (boot_data.flashboot_size % 512) {
+                    rkrc4(boot_data.flashboot + x * 512, boot_data.flashboot_size % 512);
+                }
+            }
+        }
+        fclose(fp);
+    }
+
+    if (action == 'P' || (action == 'F' && ifile)) {
+        /* read once, whatever the number of devices */
+        int fd = 0, sizeRead;
+        if (action == 'F' && (fd = open(ifile, O_RDONLY)) < 0)
+            fatal("cannot open %s: %s\n", ifile, strerror(errno));
+        memcpy(plan.param, "PARM", 4);
+        if ((sizeRead = read(fd, plan.param + 8, RKFT_RKPARAM_BLOCKSIZE - 12)) < 0)
+            fatal("read error: %s\n", strerror(errno));
+        PUT32LE(plan.param + 4, sizeRead);
+        PUT32LE(plan.param + 8 + sizeRead, rkcrc32(0, plan.param + 8, sizeRead));
+        plan.has_param = 1;
+        if (fd) close(fd);
+        ifile = NULL;
+    }
+
+    plan.action = action;
+    plan.offset = offset;
+    plan.size = size;
+    plan.flag = flag;
+    plan.wipe = wipe;
+    plan.partname = partname;
+    plan.ifile = ifile;
+    plan.boot_data = boot_data;
+    plan.depth = depth;
+    plan.tune = tune;
+    plan.blank = blank;
+    plan.diff = diff;
+    plan.blocksize = blocksize;
+    plan.compress = compress;
+    plan.verify = verify;
+
+    if (plan.journal && (all || !strchr("drf", action)))
+        fatal("--resume works with d, r and f on one device\n");
+    if (plan.journal && compress)
+        fatal("--resume cannot append to a compressed dump\n");
+
+    if (all) {
+        if (strchr("dprz", action))
+            fatal("'%c' writes to stdout and cannot run on several devices\n", action);
+#ifndef _WIN32
+        if (wait) return run_station(&plan, mode);
+#endif
+        return run_all(&plan, mode);
+    }
+
+    if (wait) {
+        info("waiting for a device...\n");
+        if (rkusb_watch(mode, first_arrival, arrived))
+            fatal("cannot watch for devices\n");
+        path = arrived;
+    }
+
+    return run_path(&plan, path, NULL);
 }
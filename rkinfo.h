@@ -0,0 +1,31 @@
+#ifndef _RKINFO_H_
+#define _RKINFO_H_
+
+/*
+ * Messages of the command line tools.  librkflash itself never prints or
+ * exits, it returns errors for these to report.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+
+static const char *const strings[2] = { "info", "fatal" };
+static const char *info_prefix = "";    /* tells devices apart when several run */
+static int info_progress = 1;           /* 0 drops the infocr progress lines */
+
+static void info_and_fatal(const int s, const int cr, char *f, ...) {
+    va_list ap;
+    if (cr && !info_progress) return;
+    va_start(ap,f);
+    fprintf(stderr, "%s%s%s: ", cr ? "\r" : "", info_prefix, strings[s]);
+    vfprintf(stderr, f, ap);
+    va_end(ap);
+    if (s) exit(s);
+}
+
+#define info(...)    info_and_fatal(0, 0, __VA_ARGS__)
+#define infocr(...)  info_and_fatal(0, 1, __VA_ARGS__)
+#define fatal(...)   info_and_fatal(1, 0, __VA_ARGS__)
+
+#endif /* !_RKINFO_H_ */
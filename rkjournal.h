@@ -0,0 +1,165 @@
+#ifndef _RKJOURNAL_H_
+#define _RKJOURNAL_H_
+
+/*
+ * Checkpoint journal for long transfers (--resume).
+ *
+ * The first line names the transfer: action, sector range, transfer size
+ * and device, everything that must match to carry on where a previous run
+ * stopped.  Every further line is a checkpoint "end hash": all sectors
+ * below end are done, and hash chains what was sent up to there so that a
+ * resumed run can tell it is replaying the same source.  Lines are only
+ * ever appended, so a run killed at any point leaves a usable journal.
+ *
+ * Chunks are pushed as they are submitted and marked done as they
+ * complete, possibly out of order and from another thread; the mark only
+ * moves over a contiguous run of done chunks.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#ifdef _WIN32
+#include <io.h>
+#define fsync _commit
+#endif
+
+#define RKJOURNAL_STEP  0x8000          /* sectors between checkpoints */
+
+typedef struct {
+    uint32_t start, end, hash;
+    int done;
+} rkjournal_chunk;
+
+typedef struct {
+    FILE *fp;
+    const char *name;
+    int sync;                           /* fd flushed before each checkpoint, or -1 */
+    uint32_t resume, rhash;             /* last checkpoint of the previous run */
+    uint32_t mark, hash;                /* everything below mark is done */
+    uint32_t saved;                     /* mark of the last checkpoint written */
+    rkjournal_chunk *q;                 /* chunks in flight, in submission order */
+    size_t head, n, max;
+    pthread_mutex_t lock;
+} rkjournal;
+
+/*
+ * Opens the journal of the transfer described by key, which starts at
+ * sector start, creating it if needed.  Returns -1 if it cannot be used,
+ * with errno 0 when it belongs to another transfer.  j->resume is where
+ * the previous run got to.
+ */
+static int rkjournal_open(rkjournal *j, const char *name, const char *key, uint32_t start) {
+    char line[256];
+    unsigned long end, hash;
+    long good;
+
+    memset(j, 0, sizeof(*j));
+    j->name = name;
+    j->sync = -1;
+    j->resume = start;
+    pthread_mutex_init(&j->lock, NULL);
+
+    if ((j->fp = fopen(name, "r+"))) {
+        if (!fgets(line, sizeof(line), j->fp) || strncmp(line, key, strlen(key)) ||
+            strcmp(line + strlen(key), "\n")) {
+            fclose(j->fp);
+            errno = 0;
+            return -1;
+        }
+        /* a checkpoint cut short by the end of the last run is dropped */
+        good = ftell(j->fp);
+        while (fgets(line, sizeof(line), j->fp) && strchr(line, '\n') &&
+               sscanf(line, "%lx %lx", &end, &hash) == 2) {
+            j->resume = end;
+            j->rhash = hash;
+            good = ftell(j->fp);
+        }
+        if (fflush(j->fp) || ftruncate(fileno(j->fp), good) || fseek(j->fp, 0, SEEK_END)) {
+            fclose(j->fp);
+            return -1;
+        }
+    } else if (errno != ENOENT || !(j->fp = fopen(name, "w")) ||
+               fprintf(j->fp, "%s\n", key) < 0 || fflush(j->fp)) {
+        if (j->fp) fclose(j->fp);
+        return -1;
+    }
+    j->mark = j->saved = j->resume;
+    j->hash = j->rhash;
+    return 0;
+}
+
+/* writes a checkpoint at the mark, once what it covers is on disk */
+static int rkjournal_save(rkjournal *j) {
+    if (j->mark == j->saved) return 0;
+    if (j->sync >= 0 && fsync(j->sync)) return -1;
+    if (fprintf(j->fp, "%x %x\n", j->mark, j->hash) < 0 || fflush(j->fp) ||
+        fsync(fileno(j->fp)))
+        return -1;
+    j->saved = j->mark;
+    return 0;
+}
+
+/* a chunk [start, end) was submitted; hash chains the source up to end */
+static int rkjournal_push(rkjournal *j, uint32_t start, uint32_t end, uint32_t hash) {
+    rkjournal_chunk *q;
+    int r = 0;
+
+    pthread_mutex_lock(&j->lock);
+    if (j->head + j->n == j->max) {
+        if (j->head > j->n) {
+            memmove(j->q, j->q + j->head, j->n * sizeof(*q));
+            j->head = 0;
+        } else if ((q = realloc(j->q, (j->max ? j->max * 2 : 16) * sizeof(*q)))) {
+            j->q = q;
+            j->max = j->max ? j->max * 2 : 16;
+        } else {
+            r = -1;
+        }
+    }
+    if (!r) {
+        q = &j->q[j->head + j->n++];
+        q->start = start;
+        q->end = end;
+        q->hash = hash;
+        q->done = 0;
+    }
+    pthread_mutex_unlock(&j->lock);
+    return r;
+}
+
+/* the chunk starting at start is done: moves the mark over the done
+ * chunks at the front and checkpoints every RKJOURNAL_STEP sectors */
+static int rkjournal_done(rkjournal *j, uint32_t start) {
+    size_t i;
+    int r = 0;
+
+    pthread_mutex_lock(&j->lock);
+    for (i = j->head; i < j->head + j->n && j->q[i].start != start; i++);
+    if (i < j->head + j->n) j->q[i].done = 1;
+    for (; j->n && j->q[j->head].done; j->head++, j->n--) {
+        j->mark = j->q[j->head].end;
+        j->hash = j->q[j->head].hash;
+    }
+    if (j->mark - j->saved >= RKJOURNAL_STEP)
+        r = rkjournal_save(j);
+    pthread_mutex_unlock(&j->lock);
+    return r;
+}
+
+/* writes the last checkpoint, or removes the journal of a finished transfer */
+static int rkjournal_close(rkjournal *j, int finished) {
+    int r = finished ? 0 : rkjournal_save(j);
+
+    if (fclose(j->fp)) r = -1;
+    if (finished && remove(j->name)) r = -1;
+    free(j->q);
+    pthread_mutex_destroy(&j->lock);
+    return r;
+}
+
+#endif /* !_RKJOURNAL_H_ */
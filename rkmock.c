@@ -0,0 +1,565 @@
+/* rkmock - the emulated devices behind rkmock.h, linked into librkflash
+ * instead of libusb-1.0 in RKUSB_MOCK builds */
+
+#include "rkmock.h"
+
+static pthread_mutex_t rkmock_lock = PTHREAD_MUTEX_INITIALIZER;
+static rkmock_device rkmock_devs[RKMOCK_MAX_DEVICES];
+static int rkmock_ndevs = -1;
+static uint64_t rkmock_latency, rkmock_bandwidth;
+
+static uint64_t rkmock_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void rkmock_sleep_until(uint64_t t) {
+    uint64_t now = rkmock_now();
+    struct timespec ts;
+
+    if (t <= now) return;
+    ts.tv_sec = (t - now) / 1000000000ull;
+    ts.tv_nsec = (t - now) % 1000000000ull;
+    nanosleep(&ts, NULL);
+}
+
+static unsigned long rkmock_env(const char *name, unsigned long def) {
+    const char *v = getenv(name);
+    return v && *v ? strtoul(v, NULL, 0) : def;
+}
+
+/* time the link needs to move len bytes */
+static uint64_t rkmock_wire(uint32_t len) {
+    return rkmock_bandwidth ? (uint64_t)len * 1000ull / rkmock_bandwidth : 0;
+}
+
+static void rkmock_setup(void) {
+    const char *file = getenv("RKMOCK_FILE"), *mode = getenv("RKMOCK_MODE");
+    char path[4096];
+
+    if (rkmock_ndevs >= 0) return;
+
+    rkmock_ndevs = rkmock_env("RKMOCK_DEVICES", 1);
+    if (rkmock_ndevs > RKMOCK_MAX_DEVICES) rkmock_ndevs = RKMOCK_MAX_DEVICES;
+    rkmock_latency = rkmock_env("RKMOCK_LATENCY", 0) * 1000ull;
+    rkmock_bandwidth = rkmock_env("RKMOCK_BANDWIDTH", 0);
+    if (!file || !*file) file = "rkmock.img";
+
+    for (int i = 0; i < rkmock_ndevs; i++) {
+        rkmock_device *dev = &rkmock_devs[i];
+
+        if (i) snprintf(path, sizeof(path), "%s.%d", file, i);
+        else snprintf(path, sizeof(path), "%s", file);
+
+        memset(dev, 0, sizeof(*dev));
+        dev->index = i;
+        dev->bus = 1;
+        dev->port[0] = 1 + i / 8;
+        dev->port[1] = 1 + i % 8;
+        dev->pid = rkmock_env("RKMOCK_PID", 0x320b);
+        dev->size = rkmock_env("RKMOCK_SIZE", 0x200000);
+        dev->erased = rkmock_env("RKMOCK_ERASED", 0xff);
+        dev->noerase = rkmock_env("RKMOCK_NOERASE", 0);
+        dev->mode = mode && !strcmp(mode, "loader") ? 0x201 : 0x200;
+        dev->probed = !(mode && !strcmp(mode, "bare"));
+        dev->fd = open(path, O_BINARY | O_RDWR | O_CREAT, 0644);
+        if (dev->fd < 0 || ftruncate(dev->fd, (off_t)dev->size * 512) < 0) {
+            fprintf(stderr, "rkmock: cannot open backing file %s\n", path);
+            exit(1);
+        }
+    }
+}
+
+int libusb_init(libusb_context **ctx) {
+    pthread_mutex_lock(&rkmock_lock);
+    rkmock_setup();
+    pthread_mutex_unlock(&rkmock_lock);
+    *ctx = calloc(1, sizeof(libusb_context));
+    if (!*ctx) return LIBUSB_ERROR_NO_MEM;
+    for (int i = 0; i < RKMOCK_MAX_DEVICES; i++) {
+        (*ctx)->devs[i].ctx = *ctx;
+        (*ctx)->devs[i].mock = &rkmock_devs[i];
+    }
+    return 0;
+}
+
+void libusb_exit(libusb_context *ctx) {
+    struct rusage ru;
+
+    if (getenv("RKMOCK_STATS")) {
+        for (int i = 0; i < rkmock_ndevs; i++)
+            fprintf(stderr, "rkmock: device %d: %lu commands, %lu bytes\n",
+                    i, rkmock_devs[i].ncmd, rkmock_devs[i].nbytes);
+        if (!getrusage(RUSAGE_SELF, &ru))
+            fprintf(stderr, "rkmock: cpu %ld.%06ld s user, %ld.%06ld s system\n",
+                    (long)ru.ru_utime.tv_sec, (long)ru.ru_utime.tv_usec,
+                    (long)ru.ru_stime.tv_sec, (long)ru.ru_stime.tv_usec);
+    }
+    free(ctx);
+}
+
+int libusb_set_option(libusb_context *ctx, enum libusb_option option, ...) {
+    (void)ctx; (void)option;
+    return 0;
+}
+
+const char *libusb_error_name(int code) {
+    switch (code) {
+    case LIBUSB_SUCCESS:              return "LIBUSB_SUCCESS";
+    case LIBUSB_ERROR_IO:             return "LIBUSB_ERROR_IO";
+    case LIBUSB_ERROR_NO_DEVICE:      return "LIBUSB_ERROR_NO_DEVICE";
+    case LIBUSB_ERROR_TIMEOUT:        return "LIBUSB_ERROR_TIMEOUT";
+    case LIBUSB_ERROR_PIPE:           return "LIBUSB_ERROR_PIPE";
+    case LIBUSB_ERROR_NO_MEM:         return "LIBUSB_ERROR_NO_MEM";
+    case LIBUSB_ERROR_NOT_SUPPORTED:  return "LIBUSB_ERROR_NOT_SUPPORTED";
+    default:                          return "LIBUSB_ERROR_OTHER";
+    }
+}
+
+ssize_t libusb_get_device_list(libusb_context *ctx, libusb_device ***list) {
+    uint64_t now = rkmock_now();
+    int n = 0;
+
+    *list = calloc(rkmock_ndevs + 1, sizeof(libusb_device *));
+    pthread_mutex_lock(&rkmock_lock);
+    for (int i = 0; i < rkmock_ndevs; i++)
+        if (rkmock_devs[i].gone_until <= now)
+            (*list)[n++] = &ctx->devs[i];
+    pthread_mutex_unlock(&rkmock_lock);
+    return n;
+}
+
+void libusb_free_device_list(libusb_device **list, int unref) {
+    (void)unref;
+    free(list);
+}
+
+int libusb_get_device_descriptor(libusb_device *dev, struct libusb_device_descriptor *desc) {
+    memset(desc, 0, sizeof(*desc));
+    desc->bLength = 18;
+    desc->bDescriptorType = 1;
+    desc->bcdUSB = dev->mock->mode;
+    desc->idVendor = 0x2207;
+    desc->idProduct = dev->mock->pid;
+    return 0;
+}
+
+uint8_t libusb_get_bus_number(libusb_device *dev) {
+    return dev->mock->bus;
+}
+
+int libusb_get_port_numbers(libusb_device *dev, uint8_t *ports, int len) {
+    if (len < 2) return LIBUSB_ERROR_OVERFLOW;
+    ports[0] = dev->mock->port[0];
+    ports[1] = dev->mock->port[1];
+    return 2;
+}
+
+libusb_device *libusb_get_device(libusb_device_handle *handle) {
+    return &handle->ctx->devs[handle->dev->index];
+}
+
+libusb_device *libusb_ref_device(libusb_device *dev) {
+    return dev;
+}
+
+void libusb_unref_device(libusb_device *dev) {
+    (void)dev;
+}
+
+int libusb_open(libusb_device *dev, libusb_device_handle **handle) {
+    *handle = calloc(1, sizeof(libusb_device_handle));
+    if (!*handle) return LIBUSB_ERROR_NO_MEM;
+    (*handle)->ctx = dev->ctx;
+    (*handle)->dev = dev->mock;
+    (*handle)->generation = dev->mock->generation;
+    return 0;
+}
+
+void libusb_close(libusb_device_handle *handle) {
+    free(handle);
+}
+
+int libusb_kernel_driver_active(libusb_device_handle *handle, int iface) {
+    (void)handle; (void)iface;
+    return 0;
+}
+
+int libusb_detach_kernel_driver(libusb_device_handle *handle, int iface) {
+    (void)handle; (void)iface;
+    return 0;
+}
+
+int libusb_claim_interface(libusb_device_handle *handle, int iface) {
+    (void)handle; (void)iface;
+    return 0;
+}
+
+int libusb_release_interface(libusb_device_handle *handle, int iface) {
+    (void)handle; (void)iface;
+    return 0;
+}
+
+int libusb_has_capability(uint32_t capability) {
+    return capability == LIBUSB_CAP_HAS_HOTPLUG;
+}
+
+int libusb_hotplug_register_callback(libusb_context *ctx, int events, int flags,
+        int vendor_id, int product_id, int dev_class,
+        libusb_hotplug_callback_fn cb_fn, void *user_data,
+        libusb_hotplug_callback_handle *callback_handle) {
+    (void)events; (void)flags; (void)vendor_id; (void)product_id; (void)dev_class;
+    ctx->hotplug = cb_fn;
+    ctx->hotplug_data = user_data;
+    memset(ctx->hotplug_seen, 0, sizeof(ctx->hotplug_seen));
+    if (callback_handle) *callback_handle = 1;
+    return 0;
+}
+
+void libusb_hotplug_deregister_callback(libusb_context *ctx,
+        libusb_hotplug_callback_handle callback_handle) {
+    (void)callback_handle;
+    ctx->hotplug = NULL;
+}
+
+struct libusb_transfer *libusb_alloc_transfer(int iso_packets) {
+    (void)iso_packets;
+    return calloc(1, sizeof(struct libusb_transfer));
+}
+
+void libusb_free_transfer(struct libusb_transfer *transfer) {
+    free(transfer);
+}
+
+/* schedule a completion, keeping the list sorted by due time */
+static void rkmock_complete(libusb_context *ctx, struct libusb_transfer *t,
+                            enum libusb_transfer_status status, uint64_t due) {
+    struct libusb_transfer **p = &ctx->done;
+
+    t->status = status;
+    t->mock_due = due;
+    while (*p && (*p)->mock_due <= due) p = &(*p)->mock_next;
+    t->mock_next = *p;
+    *p = t;
+}
+
+static void rkmock_push(rkmock_device *dev, uint8_t *data, uint32_t len, uint64_t ready) {
+    rkmock_packet *pk = &dev->fifo[(dev->fifo_head + dev->fifo_count++) % RKMOCK_FIFO];
+    pk->data = data;
+    pk->len = len;
+    pk->pos = 0;
+    pk->ready = ready;
+}
+
+static void rkmock_status(rkmock_device *dev, const uint8_t *tag, int failed, uint64_t ready) {
+    uint8_t *res = calloc(1, 13);
+    memcpy(res, "USBS", 4);
+    memcpy(res + 4, tag, 4);
+    res[12] = failed;
+    rkmock_push(dev, res, 13, ready);
+}
+
+/* hand queued device-to-host packets to waiting IN transfers */
+static void rkmock_feed(libusb_context *ctx, rkmock_device *dev) {
+    while (ctx->in && dev->fifo_count) {
+        struct libusb_transfer *t = ctx->in;
+        rkmock_packet *pk = &dev->fifo[dev->fifo_head];
+        uint32_t n = pk->len - pk->pos;
+        uint64_t due = pk->ready > t->mock_due ? pk->ready : t->mock_due;
+
+        if (n > (uint32_t)t->length) n = t->length;
+        memcpy(t->buffer, pk->data + pk->pos, n);
+        t->actual_length = n;
+        pk->pos += n;
+        if (pk->pos == pk->len) {
+            free(pk->data);
+            dev->fifo_head = (dev->fifo_head + 1) % RKMOCK_FIFO;
+            dev->fifo_count--;
+        }
+        ctx->in = t->mock_next;
+        rkmock_complete(ctx, t, LIBUSB_TRANSFER_COMPLETED, due + rkmock_latency / 2);
+    }
+}
+
+static void rkmock_fill(rkmock_device *dev, uint32_t offset, uint32_t n, uint8_t value) {
+    uint8_t buf[0x10000];
+
+    memset(buf, value, sizeof(buf));
+    while (n) {
+        uint32_t c = n > sizeof(buf) / 512 ? sizeof(buf) / 512 : n;
+        if (pwrite(dev->fd, buf, c * 512, (off_t)offset * 512) < 0) break;
+        offset += c;
+        n -= c;
+    }
+}
+
+/* execute one USBC command block; returns the time it was accepted */
+static uint64_t rkmock_command(rkmock_device *dev, const uint8_t *cmd, uint64_t arrival) {
+    uint32_t op = (uint32_t)cmd[12] << 24 | cmd[13] << 16 | cmd[14] << 8 | cmd[15];
+    uint32_t offset = (uint32_t)cmd[17] << 24 | cmd[18] << 16 | cmd[19] << 8 | cmd[20];
+    uint32_t n = cmd[22] << 8 | cmd[23];
+    uint64_t start = arrival > dev->busy ? arrival : dev->busy;
+    uint8_t *data = NULL;
+    uint32_t len = 0;
+    int failed = 0;
+
+    dev->ncmd++;
+    if (memcmp(cmd, "USBC", 4)) failed = 1;
+    else switch (op) {
+    case 0x80000600:    /* TESTUNITREADY */
+    case 0x000006ff:    /* RESETDEVICE */
+        break;
+    case 0x80000601:    /* READFLASHID */
+        len = 5;
+        data = calloc(1, len);
+        if (dev->probed) memcpy(data, "EMMC ", 5);
+        break;
+    case 0x8000061a:    /* READFLASHINFO */
+        len = 512;
+        data = calloc(1, len);
+        data[0] = dev->size;
+        data[1] = dev->size >> 8;
+        data[2] = dev->size >> 16;
+        data[3] = dev->size >> 24;
+        data[4] = 0x00;     /* block size: 512 KiB */
+        data[5] = 0x04;
+        data[6] = 0x20;     /* page size: 16 KiB */
+        data[7] = 0x00;
+        data[8] = 0x28;
+        data[10] = 0x01;
+        break;
+    case 0x8000061b:    /* READCHIPINFO */
+        len = 16;
+        data = calloc(1, len);
+        memcpy(data, "2223MOCK7010V20", 16);
+        break;
+    case 0x80000a14:    /* READLBA */
+        if (!dev->probed || offset + n > dev->size) {
+            failed = 1;
+            break;
+        }
+        len = n * 512;
+        data = malloc(len);
+        if (pread(dev->fd, data, len, (off_t)offset * 512) != (ssize_t)len)
+            memset(data, 0, len);
+        dev->nbytes += len;
+        break;
+    case 0x00000a15:    /* WRITELBA, data phase follows */
+        if (!dev->probed || offset + n > dev->size) {
+            failed = 1;
+            break;
+        }
+        dev->wr_offset = offset;
+        dev->wr_left = n * 512;
+        memcpy(dev->wr_tag, cmd + 4, 4);
+        dev->busy = start;
+        return start;
+    case 0x00000a25:    /* ERASE_LBA */
+    case 0x00000a0b:    /* ERASEFORCE */
+        if (dev->noerase || !dev->probed || offset + n > dev->size) {
+            failed = 1;
+            break;
+        }
+        rkmock_fill(dev, offset, n, dev->erased);
+        break;
+    default:
+        failed = 1;
+        break;
+    }
+
+    dev->busy = start + rkmock_wire(len);
+    if (data) rkmock_push(dev, data, len, dev->busy);
+    rkmock_status(dev, cmd + 4, failed, dev->busy);
+    return start;
+}
+
+int libusb_submit_transfer(struct libusb_transfer *t) {
+    libusb_device_handle *h = t->dev_handle;
+    libusb_context *ctx = h->ctx;
+    rkmock_device *dev = h->dev;
+    uint64_t now = rkmock_now(), arrival = now + rkmock_latency / 2;
+
+    pthread_mutex_lock(&rkmock_lock);
+    t->mock_next = NULL;
+    t->actual_length = 0;
+    t->mock_queued = 1;
+
+    {
+        /* RKMOCK_RESET_AFTER=bytes: the device falls off the bus once that
+         * much data went either way, like a USB reset */
+        const char *r = getenv("RKMOCK_RESET_AFTER");
+        if (r && dev->nbytes >= strtoull(r, NULL, 0) && h->generation == dev->generation)
+            dev->generation++;
+    }
+    if (h->generation != dev->generation) {
+        rkmock_complete(ctx, t, LIBUSB_TRANSFER_NO_DEVICE, now);
+    } else if (t->endpoint & LIBUSB_ENDPOINT_IN) {
+        struct libusb_transfer **p = &ctx->in;
+        while (*p) p = &(*p)->mock_next;
+        t->mock_due = now;
+        *p = t;
+        rkmock_feed(ctx, dev);
+    } else if (dev->wr_left) {
+        /* data phase of a pending WRITELBA */
+        uint32_t len = (uint32_t)t->length > dev->wr_left ? dev->wr_left : (uint32_t)t->length;
+        uint64_t start = arrival > dev->busy ? arrival : dev->busy;
+
+        if (pwrite(dev->fd, t->buffer, len, (off_t)dev->wr_offset * 512) < 0)
+            len = 0;
+        {
+            /* RKMOCK_FLAKY=n: every nth data phase lands with a flipped bit */
+            static unsigned long writes;
+            const char *f = getenv("RKMOCK_FLAKY");
+            if (len && f && atoi(f) > 0 && ++writes % atoi(f) == 0) {
+                uint8_t c = ((uint8_t *)t->buffer)[0] ^ 1;
+                if (pwrite(dev->fd, &c, 1, (off_t)dev->wr_offset * 512) < 0) len = 0;
+            }
+        }
+        dev->nbytes += len;
+        dev->wr_offset += len / 512;
+        dev->wr_left -= len;
+        dev->busy = start + rkmock_wire(len);
+        t->actual_length = len;
+        if (!dev->wr_left) rkmock_status(dev, dev->wr_tag, !len, dev->busy);
+        rkmock_complete(ctx, t, LIBUSB_TRANSFER_COMPLETED, dev->busy);
+        rkmock_feed(ctx, dev);
+    } else {
+        uint64_t accepted = rkmock_command(dev, t->buffer, arrival);
+        t->actual_length = t->length;
+        rkmock_complete(ctx, t, LIBUSB_TRANSFER_COMPLETED, accepted);
+        rkmock_feed(ctx, dev);
+    }
+    pthread_mutex_unlock(&rkmock_lock);
+    return 0;
+}
+
+int libusb_cancel_transfer(struct libusb_transfer *t) {
+    libusb_context *ctx = t->dev_handle->ctx;
+    struct libusb_transfer **p;
+
+    pthread_mutex_lock(&rkmock_lock);
+    for (p = &ctx->in; *p; p = &(*p)->mock_next) {
+        if (*p == t) {
+            *p = t->mock_next;
+            rkmock_complete(ctx, t, LIBUSB_TRANSFER_CANCELLED, rkmock_now());
+            pthread_mutex_unlock(&rkmock_lock);
+            return 0;
+        }
+    }
+    pthread_mutex_unlock(&rkmock_lock);
+    return LIBUSB_ERROR_NOT_FOUND;
+}
+
+static void rkmock_hotplug(libusb_context *ctx) {
+    uint64_t now = rkmock_now();
+
+    if (!ctx->hotplug) return;
+    for (int i = 0; i < rkmock_ndevs; i++) {
+        int present = rkmock_devs[i].gone_until <= now;
+
+        if (present != ctx->hotplug_seen[i]) {
+            ctx->hotplug_seen[i] = present;
+            if (ctx->hotplug(ctx, &ctx->devs[i], present ? LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED
+                                               : LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+                             ctx->hotplug_data)) {
+                ctx->hotplug = NULL;
+                return;
+            }
+        }
+    }
+}
+
+int libusb_handle_events_timeout_completed(libusb_context *ctx, struct timeval *tv, int *completed) {
+    uint64_t limit = rkmock_now() + (tv ? tv->tv_sec * 1000000000ull + tv->tv_usec * 1000ull
+                                        : 60 * 1000000000ull);
+    struct libusb_transfer *t;
+
+    rkmock_hotplug(ctx);
+    pthread_mutex_lock(&rkmock_lock);
+    t = ctx->done;
+    if (!t || t->mock_due > limit) {
+        pthread_mutex_unlock(&rkmock_lock);
+        if (completed && *completed) return 0;
+        if (t && t->mock_due < limit) limit = t->mock_due;
+        for (int i = 0; ctx->hotplug && i < rkmock_ndevs; i++)
+            if (rkmock_devs[i].gone_until > rkmock_now() && rkmock_devs[i].gone_until < limit)
+                limit = rkmock_devs[i].gone_until;
+        rkmock_sleep_until(limit);
+        rkmock_hotplug(ctx);
+        return 0;
+    }
+    ctx->done = t->mock_next;
+    t->mock_queued = 0;
+    pthread_mutex_unlock(&rkmock_lock);
+
+    rkmock_sleep_until(t->mock_due);
+    if (t->callback) t->callback(t);
+    return 0;
+}
+
+int libusb_handle_events_timeout(libusb_context *ctx, struct timeval *tv) {
+    return libusb_handle_events_timeout_completed(ctx, tv, NULL);
+}
+
+int libusb_handle_events_completed(libusb_context *ctx, int *completed) {
+    return libusb_handle_events_timeout_completed(ctx, NULL, completed);
+}
+
+int libusb_handle_events(libusb_context *ctx) {
+    return libusb_handle_events_timeout_completed(ctx, NULL, NULL);
+}
+
+static void rkmock_sync_cb(struct libusb_transfer *t) {
+    *(int *)t->user_data = 1;
+}
+
+int libusb_bulk_transfer(libusb_device_handle *h, unsigned char endpoint,
+        unsigned char *data, int length, int *transferred, unsigned int timeout) {
+    struct libusb_transfer t;
+    int done = 0, r;
+
+    memset(&t, 0, sizeof(t));
+    libusb_fill_bulk_transfer(&t, h, endpoint, data, length, rkmock_sync_cb, &done, timeout);
+    libusb_submit_transfer(&t);
+    while (!done) {
+        if (endpoint & LIBUSB_ENDPOINT_IN && t.mock_queued && !h->ctx->done) {
+            /* nothing will ever answer this IN transfer */
+            libusb_cancel_transfer(&t);
+        }
+        libusb_handle_events_completed(h->ctx, &done);
+    }
+    if (transferred) *transferred = t.actual_length;
+    switch (t.status) {
+    case LIBUSB_TRANSFER_COMPLETED: r = 0; break;
+    case LIBUSB_TRANSFER_NO_DEVICE: r = LIBUSB_ERROR_NO_DEVICE; break;
+    case LIBUSB_TRANSFER_CANCELLED: r = LIBUSB_ERROR_TIMEOUT; break;
+    default:                        r = LIBUSB_ERROR_IO; break;
+    }
+    return r;
+}
+
+int libusb_control_transfer(libusb_device_handle *h, uint8_t request_type,
+        uint8_t request, uint16_t value, uint16_t index,
+        unsigned char *data, uint16_t length, unsigned int timeout) {
+    rkmock_device *dev = h->dev;
+
+    (void)request_type; (void)request; (void)value; (void)timeout; (void)data;
+    pthread_mutex_lock(&rkmock_lock);
+    if (h->generation != dev->generation) {
+        pthread_mutex_unlock(&rkmock_lock);
+        return LIBUSB_ERROR_NO_DEVICE;
+    }
+    dev->ncmd++;
+    dev->nbytes += length;
+    /* the last (short) block of the usbplug starts it, which makes the
+     * device drop off the bus and come back with its storage probed */
+    if (index == 0x472 && length < 4096) {
+        dev->probed = 1;
+        dev->generation++;
+        dev->gone_until = rkmock_now() + 300 * 1000000ull;
+    }
+    pthread_mutex_unlock(&rkmock_lock);
+    rkmock_sleep_until(rkmock_now() + rkmock_latency + rkmock_wire(length));
+    return length;
+}
@@ -0,0 +1,248 @@
+/* rkmock - file-backed RockUSB device for RKUSB_MOCK builds
+ *
+ * Provides the subset of the libusb-1.0 API used by librkflash and emulates
+ * the USBC/USBS protocol described in doc/protocol.txt on top of a sparse
+ * backing file, so that the transfer engine can be exercised without a
+ * board attached.
+ *
+ * Configuration is read from the environment:
+ *
+ *   RKMOCK_FILE       backing file (default rkmock.img, ".N" appended for
+ *                     every device after the first)
+ *   RKMOCK_SIZE       flash size in sectors (default 0x200000, 1 GiB)
+ *   RKMOCK_DEVICES    number of emulated devices (default 1)
+ *   RKMOCK_PID        product id (default 0x320b, RK322X)
+ *   RKMOCK_MODE       "maskrom" (default), "loader" or "bare" (maskrom
+ *                     without usbplug, storage not probed yet)
+ *   RKMOCK_LATENCY    round-trip latency per command in microseconds
+ *   RKMOCK_BANDWIDTH  link bandwidth in MB/s (0 = unlimited)
+ *   RKMOCK_NOERASE    reject ERASE_LBA/ERASEFORCE like old loaders do
+ *   RKMOCK_ERASED     value read back from erased sectors (default 0xff)
+ *   RKMOCK_STATS      print command/byte counters and the CPU time used
+ *                     on libusb_exit
+ *   RKMOCK_FLAKY      store every nth WRITELBA data phase with a flipped bit
+ *   RKMOCK_RESET_AFTER  drop off the bus once this many bytes went through,
+ *                     like a USB reset
+ *
+ * Every process sees the devices afresh, so their state (probed, gone)
+ * only lasts as long as the process; the flash contents live on in the
+ * backing files.  POSIX only.
+ */
+
+#ifndef _RKMOCK_H_
+#define _RKMOCK_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+#define LIBUSB_ENDPOINT_IN                  0x80
+#define LIBUSB_ENDPOINT_OUT                 0x00
+#define LIBUSB_REQUEST_TYPE_VENDOR          (0x02 << 5)
+#define LIBUSB_TRANSFER_TYPE_BULK           2
+#define LIBUSB_HOTPLUG_MATCH_ANY            -1
+#define LIBUSB_CAP_HAS_HOTPLUG              0x0001
+
+enum libusb_option { LIBUSB_OPTION_LOG_LEVEL = 0 };
+enum libusb_log_level { LIBUSB_LOG_LEVEL_NONE = 0, LIBUSB_LOG_LEVEL_ERROR,
+    LIBUSB_LOG_LEVEL_WARNING, LIBUSB_LOG_LEVEL_INFO, LIBUSB_LOG_LEVEL_DEBUG };
+
+enum libusb_error {
+    LIBUSB_SUCCESS             = 0,
+    LIBUSB_ERROR_IO            = -1,
+    LIBUSB_ERROR_INVALID_PARAM = -2,
+    LIBUSB_ERROR_ACCESS        = -3,
+    LIBUSB_ERROR_NO_DEVICE     = -4,
+    LIBUSB_ERROR_NOT_FOUND     = -5,
+    LIBUSB_ERROR_BUSY          = -6,
+    LIBUSB_ERROR_TIMEOUT       = -7,
+    LIBUSB_ERROR_OVERFLOW      = -8,
+    LIBUSB_ERROR_PIPE          = -9,
+    LIBUSB_ERROR_INTERRUPTED   = -10,
+    LIBUSB_ERROR_NO_MEM        = -11,
+    LIBUSB_ERROR_NOT_SUPPORTED = -12,
+    LIBUSB_ERROR_OTHER         = -99,
+};
+
+enum libusb_transfer_status {
+    LIBUSB_TRANSFER_COMPLETED,
+    LIBUSB_TRANSFER_ERROR,
+    LIBUSB_TRANSFER_TIMED_OUT,
+    LIBUSB_TRANSFER_CANCELLED,
+    LIBUSB_TRANSFER_STALL,
+    LIBUSB_TRANSFER_NO_DEVICE,
+    LIBUSB_TRANSFER_OVERFLOW,
+};
+
+typedef enum {
+    LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED = 1,
+    LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT    = 2,
+} libusb_hotplug_event;
+
+typedef enum {
+    LIBUSB_HOTPLUG_NO_FLAGS  = 0,
+    LIBUSB_HOTPLUG_ENUMERATE = 1,
+} libusb_hotplug_flag;
+
+#define LIBUSB_CALL
+
+typedef struct libusb_context libusb_context;
+typedef struct libusb_device libusb_device;
+typedef struct libusb_device_handle libusb_device_handle;
+typedef int libusb_hotplug_callback_handle;
+
+struct libusb_device_descriptor {
+    uint8_t  bLength;
+    uint8_t  bDescriptorType;
+    uint16_t bcdUSB;
+    uint8_t  bDeviceClass;
+    uint8_t  bDeviceSubClass;
+    uint8_t  bDeviceProtocol;
+    uint8_t  bMaxPacketSize0;
+    uint16_t idVendor;
+    uint16_t idProduct;
+    uint16_t bcdDevice;
+    uint8_t  iManufacturer;
+    uint8_t  iProduct;
+    uint8_t  iSerialNumber;
+    uint8_t  bNumConfigurations;
+};
+
+struct libusb_transfer;
+typedef void (*libusb_transfer_cb_fn)(struct libusb_transfer *transfer);
+typedef int (*libusb_hotplug_callback_fn)(libusb_context *ctx,
+    libusb_device *device, libusb_hotplug_event event, void *user_data);
+
+struct libusb_transfer {
+    libusb_device_handle *dev_handle;
+    uint8_t flags;
+    unsigned char endpoint;
+    unsigned char type;
+    unsigned int timeout;
+    enum libusb_transfer_status status;
+    int length;
+    int actual_length;
+    libusb_transfer_cb_fn callback;
+    void *user_data;
+    unsigned char *buffer;
+    int num_iso_packets;
+
+    /* emulation bookkeeping */
+    struct libusb_transfer *mock_next;
+    uint64_t mock_due;
+    int mock_queued;
+};
+
+#define RKMOCK_MAX_DEVICES  32
+#define RKMOCK_FIFO         64
+
+/* one device-to-host packet waiting for an IN transfer */
+typedef struct {
+    uint8_t *data;
+    uint32_t len, pos;
+    uint64_t ready;
+} rkmock_packet;
+
+typedef struct {
+    int index;
+    uint8_t bus, port[2];
+    uint16_t pid, mode;
+    int fd, probed, noerase;
+    uint8_t erased;
+    uint32_t size;
+    uint32_t generation;
+    uint64_t gone_until;            /* re-enumerating after usbplug */
+    uint64_t busy;                  /* device busy until (ns) */
+    uint32_t wr_offset, wr_left;    /* pending WRITELBA data phase */
+    uint8_t wr_tag[4];
+    rkmock_packet fifo[RKMOCK_FIFO];
+    int fifo_head, fifo_count;
+    unsigned long ncmd, nbytes;
+} rkmock_device;
+
+/* per-context view of an emulated device */
+struct libusb_device {
+    libusb_context *ctx;
+    rkmock_device *mock;
+};
+
+struct libusb_device_handle {
+    libusb_context *ctx;
+    rkmock_device *dev;
+    uint32_t generation;
+};
+
+struct libusb_context {
+    libusb_device devs[RKMOCK_MAX_DEVICES];
+    struct libusb_transfer *done;   /* scheduled completions */
+    struct libusb_transfer *in;     /* IN transfers waiting for data */
+    libusb_hotplug_callback_fn hotplug;
+    void *hotplug_data;
+    int hotplug_seen[RKMOCK_MAX_DEVICES];
+};
+
+int libusb_init(libusb_context **ctx);
+void libusb_exit(libusb_context *ctx);
+int libusb_set_option(libusb_context *ctx, enum libusb_option option, ...);
+const char *libusb_error_name(int code);
+ssize_t libusb_get_device_list(libusb_context *ctx, libusb_device ***list);
+void libusb_free_device_list(libusb_device **list, int unref);
+int libusb_get_device_descriptor(libusb_device *dev, struct libusb_device_descriptor *desc);
+uint8_t libusb_get_bus_number(libusb_device *dev);
+int libusb_get_port_numbers(libusb_device *dev, uint8_t *ports, int len);
+libusb_device *libusb_get_device(libusb_device_handle *handle);
+libusb_device *libusb_ref_device(libusb_device *dev);
+void libusb_unref_device(libusb_device *dev);
+int libusb_open(libusb_device *dev, libusb_device_handle **handle);
+void libusb_close(libusb_device_handle *handle);
+int libusb_kernel_driver_active(libusb_device_handle *handle, int iface);
+int libusb_detach_kernel_driver(libusb_device_handle *handle, int iface);
+int libusb_claim_interface(libusb_device_handle *handle, int iface);
+int libusb_release_interface(libusb_device_handle *handle, int iface);
+int libusb_has_capability(uint32_t capability);
+int libusb_hotplug_register_callback(libusb_context *ctx, int events, int flags,
+        int vendor_id, int product_id, int dev_class,
+        libusb_hotplug_callback_fn cb_fn, void *user_data,
+        libusb_hotplug_callback_handle *callback_handle);
+void libusb_hotplug_deregister_callback(libusb_context *ctx,
+        libusb_hotplug_callback_handle callback_handle);
+struct libusb_transfer *libusb_alloc_transfer(int iso_packets);
+void libusb_free_transfer(struct libusb_transfer *transfer);
+int libusb_submit_transfer(struct libusb_transfer *t);
+int libusb_cancel_transfer(struct libusb_transfer *t);
+int libusb_handle_events_timeout_completed(libusb_context *ctx, struct timeval *tv, int *completed);
+int libusb_handle_events_timeout(libusb_context *ctx, struct timeval *tv);
+int libusb_handle_events_completed(libusb_context *ctx, int *completed);
+int libusb_handle_events(libusb_context *ctx);
+int libusb_bulk_transfer(libusb_device_handle *h, unsigned char endpoint,
+        unsigned char *data, int length, int *transferred, unsigned int timeout);
+int libusb_control_transfer(libusb_device_handle *h, uint8_t request_type,
+        uint8_t request, uint16_t value, uint16_t index,
+        unsigned char *data, uint16_t length, unsigned int timeout);
+
+static inline void libusb_fill_bulk_transfer(struct libusb_transfer *transfer,
+        libusb_device_handle *dev_handle, unsigned char endpoint,
+        unsigned char *buffer, int length, libusb_transfer_cb_fn callback,
+        void *user_data, unsigned int timeout) {
+    transfer->dev_handle = dev_handle;
+    transfer->endpoint = endpoint;
+    transfer->type = LIBUSB_TRANSFER_TYPE_BULK;
+    transfer->timeout = timeout;
+    transfer->buffer = buffer;
+    transfer->length = length;
+    transfer->user_data = user_data;
+    transfer->callback = callback;
+}
+
+#endif /* !_RKMOCK_H_ */
@@ -0,0 +1,61 @@
+#ifndef _RKPARAM_H_
+#define _RKPARAM_H_
+
+/* partition lookup in the mtdparts= list of a parameter block, e.g.
+ *   mtdparts=rk29xxnand:0x2000@0x2000(uboot),0x8000@0x4000(boot),-@0xc000(userdata)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#define RKPARAM_TO_END          0xffffffff  /* size of a trailing "-@" partition */
+
+#define RKPARAM_NO_MTDPARTS     -1
+#define RKPARAM_NO_PARTITION    -2
+#define RKPARAM_BAD_OFFSET      -3
+#define RKPARAM_BAD_SIZE        -4
+
+/* last occurrence of c in [s, end) */
+static const char *rkparam_rfind(const char *s, const char *end, char c) {
+    while (end > s)
+        if (*--end == c) return end;
+    return NULL;
+}
+
+/*
+ * Finds partition name in the parameter text and returns 0 with its offset
+ * and size in sectors, the offset counted from the start of the partitions
+ * and the size RKPARAM_TO_END for one that extends to the end of the flash.
+ * Returns one of the RKPARAM_* errors otherwise.
+ */
+static int rkparam_find(const char *param, const char *name, uint32_t *offset, uint32_t *size) {
+    const char *mtdparts, *par, *arob, *sep;
+    char partexp[256];
+
+    if (!(mtdparts = strstr(param, "mtdparts=")))
+        return RKPARAM_NO_MTDPARTS;
+
+    snprintf(partexp, sizeof(partexp), "(%s)", name);
+    if (!(par = strstr(mtdparts, partexp)))
+        return RKPARAM_NO_PARTITION;
+
+    if (!(arob = rkparam_rfind(mtdparts, par, '@')))
+        return RKPARAM_BAD_OFFSET;
+    *offset = strtoul(arob + 1, NULL, 0);
+
+    if (rkparam_rfind(mtdparts, arob, '-')) {
+        *size = RKPARAM_TO_END;
+        return 0;
+    }
+    /* the size follows the previous partition, or the mtd id if first */
+    if ((sep = rkparam_rfind(mtdparts, arob, ',')) ||
+        (sep = rkparam_rfind(mtdparts, arob, ':'))) {
+        *size = strtoul(sep + 1, NULL, 0);
+        return 0;
+    }
+    return RKPARAM_BAD_SIZE;
+}
+
+#endif /* !_RKPARAM_H_ */
@@ -0,0 +1,419 @@
+/*
+ * rkpipe - pipelined RockUSB transfers for librkflash, see rkpipe.h
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+#if RKUSB_MOCK
+#include "rkmock.h"
+#else
+#include <libusb.h>
+#endif
+#include "rkpipe.h"
+
+typedef struct {
+    rkusb_slot **q;
+    int head, count, closed;
+} rkusb_queue;
+
+struct rkusb_pipe {
+    rkusb_device *device;
+    int depth, nslots, inflight, busy, error;
+    rkusb_slot *slots;
+    rkusb_queue free, ready, done;
+    rkusb_stage produce, consume;
+    void *ctx;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+static void rkusb_queue_push(rkusb_pipe *pipe, rkusb_queue *q, rkusb_slot *slot) {
+    pthread_mutex_lock(&pipe->lock);
+    q->q[(q->head + q->count++) % pipe->nslots] = slot;
+    pthread_cond_broadcast(&pipe->cond);
+    pthread_mutex_unlock(&pipe->lock);
+}
+
+/* blocks until a slot is queued; NULL once the queue is closed and empty */
+static rkusb_slot *rkusb_queue_pop(rkusb_pipe *pipe, rkusb_queue *q) {
+    rkusb_slot *slot = NULL;
+
+    pthread_mutex_lock(&pipe->lock);
+    while (!q->count && !q->closed && !pipe->error)
+        pthread_cond_wait(&pipe->cond, &pipe->lock);
+    if (q->count && !pipe->error) {
+        slot = q->q[q->head];
+        q->head = (q->head + 1) % pipe->nslots;
+        q->count--;
+    }
+    pthread_mutex_unlock(&pipe->lock);
+    return slot;
+}
+
+static void rkusb_queue_close(rkusb_pipe *pipe, rkusb_queue *q) {
+    pthread_mutex_lock(&pipe->lock);
+    q->closed = 1;
+    pthread_cond_broadcast(&pipe->cond);
+    pthread_mutex_unlock(&pipe->lock);
+}
+
+static void rkusb_pipe_fail(rkusb_pipe *pipe, int error) {
+    pthread_mutex_lock(&pipe->lock);
+    if (!pipe->error) pipe->error = error;
+    pthread_cond_broadcast(&pipe->cond);
+    pthread_mutex_unlock(&pipe->lock);
+}
+
+void rkusb_slot_cmd(rkusb_slot *slot, uint32_t command, uint32_t offset, uint16_t nsectors) {
+    slot->command = command;
+    slot->offset = offset;
+    slot->nsectors = nsectors;
+    slot->length = (command == RKFT_CMD_READLBA || command == RKFT_CMD_WRITELBA) ? nsectors * 512 : 0;
+    rkusb_fill_cmd(slot->cmd, ++slot->tag, command, offset, nsectors);
+}
+
+static void rkusb_pipe_cb(struct libusb_transfer *t) {
+    rkusb_slot *slot = t->user_data;
+    rkusb_pipe *pipe = slot->pipe;
+
+    if (t == slot->xfer[1]) pipe->device->nbytes += t->actual_length;
+    if (t->status != LIBUSB_TRANSFER_COMPLETED) {
+        if (!slot->error) slot->error = -1;
+    } else if (t == slot->xfer[2]) {
+        if (!slot->error && (memcmp(slot->res, "USBS", 4) || slot->res[12])) slot->error = 1;
+    } else if (t == slot->xfer[1] && t->actual_length != t->length) {
+        /* a failed read answers with the status block instead of data */
+        if (t->actual_length == 13 && !memcmp(t->buffer, "USBS", 4)) {
+            memcpy(slot->res, t->buffer, 13);
+            libusb_cancel_transfer(slot->xfer[2]);
+            slot->error = 1;
+        } else {
+            slot->error = -1;
+            slot->partial = 1;
+        }
+    }
+
+    if (--slot->pending) return;
+
+    rkstats_add(rkusb_stats_entry(pipe->device, slot->command), slot->start, rkstats_clock(),
+                slot->length ? slot->xfer[1]->actual_length : 0, slot->error, slot->partial);
+    pthread_mutex_lock(&pipe->lock);
+    pipe->inflight--;
+    if (pipe->consume) pipe->busy++;
+    if (slot->error && !pipe->consume && !pipe->error) pipe->error = -1;
+    pthread_mutex_unlock(&pipe->lock);
+    rkusb_queue_push(pipe, pipe->consume ? &pipe->done : &pipe->free, slot);
+}
+
+static int rkusb_pipe_submit(rkusb_pipe *pipe, rkusb_slot *slot) {
+    libusb_device_handle *h = pipe->device->usb_handle;
+    int in = slot->command & 0x80000000;
+
+    slot->error = slot->partial = 0;
+    slot->pending = slot->length ? 3 : 2;
+    memset(slot->res, 0, sizeof(slot->res));
+
+    libusb_fill_bulk_transfer(slot->xfer[0], h, 2|LIBUSB_ENDPOINT_OUT, slot->cmd,
+                              sizeof(slot->cmd), rkusb_pipe_cb, slot, 0);
+    libusb_fill_bulk_transfer(slot->xfer[1], h, in ? 1|LIBUSB_ENDPOINT_IN : 2|LIBUSB_ENDPOINT_OUT,
+                              slot->buf, slot->length, rkusb_pipe_cb, slot, 0);
+    libusb_fill_bulk_transfer(slot->xfer[2], h, 1|LIBUSB_ENDPOINT_IN, slot->res,
+                              sizeof(slot->res), rkusb_pipe_cb, slot, 0);
+
+    pthread_mutex_lock(&pipe->lock);
+    pipe->inflight++;
+    pthread_mutex_unlock(&pipe->lock);
+
+    slot->start = rkstats_clock();
+    for (int i = 0; i < 3; i++) {
+        if (i == 1 && !slot->length) continue;
+        if (libusb_submit_transfer(slot->xfer[i])) {
+            /* the rest of the triple will never complete */
+            for (int j = i; j < 3; j++)
+                if (j != 1 || slot->length) slot->pending--;
+            rkusb_pipe_fail(pipe, -1);
+            if (!slot->pending) {
+                rkstats_add(rkusb_stats_entry(pipe->device, slot->command), slot->start,
+                            rkstats_clock(), 0, -1, 0);
+                pthread_mutex_lock(&pipe->lock);
+                pipe->inflight--;
+                pthread_mutex_unlock(&pipe->lock);
+            }
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void *rkusb_pipe_producer(void *arg) {
+    rkusb_pipe *pipe = arg;
+    rkusb_slot *slot;
+    int r;
+
+    while ((slot = rkusb_queue_pop(pipe, &pipe->free))) {
+        slot->crc = slot->tries = 0;
+        if ((r = pipe->produce(pipe->ctx, slot)) <= 0) {
+            rkusb_queue_push(pipe, &pipe->free, slot);
+            if (r < 0) rkusb_pipe_fail(pipe, r);
+            break;
+        }
+        rkusb_queue_push(pipe, &pipe->ready, slot);
+    }
+    rkusb_queue_close(pipe, &pipe->ready);
+    return NULL;
+}
+
+static void *rkusb_pipe_consumer(void *arg) {
+    rkusb_pipe *pipe = arg;
+    rkusb_slot *slot;
+    int r;
+
+    while ((slot = rkusb_queue_pop(pipe, &pipe->done))) {
+        if ((r = pipe->consume(pipe->ctx, slot)) < 0) {
+            rkusb_pipe_fail(pipe, r);
+            break;
+        }
+        rkusb_queue_push(pipe, r == RKUSB_STAGE_AGAIN ? &pipe->ready : &pipe->free, slot);
+        pthread_mutex_lock(&pipe->lock);
+        pipe->busy--;
+        pthread_cond_broadcast(&pipe->cond);
+        pthread_mutex_unlock(&pipe->lock);
+    }
+    return NULL;
+}
+
+/* page aligned, so the kernel can map transfer buffers without bouncing */
+void *rkusb_buf_alloc(size_t size) {
+#ifdef _WIN32
+    return _aligned_malloc(size, 4096);
+#else
+    void *p = NULL;
+    return posix_memalign(&p, 4096, size) ? NULL : p;
+#endif
+}
+
+void rkusb_buf_free(void *p) {
+#ifdef _WIN32
+    _aligned_free(p);
+#else
+    free(p);
+#endif
+}
+
+/* a second transfer-sized buffer, allocated on first use */
+uint8_t *rkusb_slot_aux(rkusb_slot *slot) {
+    if (!slot->aux) slot->aux = rkusb_buf_alloc(slot->pipe->device->blocksize);
+    return slot->aux;
+}
+
+/* exchanges buf and aux, e.g. to send data kept aside while reading */
+void rkusb_slot_swap(rkusb_slot *slot) {
+    uint8_t *buf = slot->buf;
+    slot->buf = rkusb_slot_aux(slot);
+    slot->aux = buf;
+}
+
+/* NULL when out of memory */
+rkusb_pipe *rkusb_pipe_new(rkusb_device *device, int depth) {
+    rkusb_pipe *pipe = calloc(1, sizeof(rkusb_pipe));
+
+    if (!pipe) return NULL;
+    if (depth < 1) depth = 1;
+    if (depth > RKFT_QUEUE_MAX) depth = RKFT_QUEUE_MAX;
+
+    pipe->device = device;
+    pipe->depth = depth;
+    /* twice the queue depth so the other stages can work while it is full */
+    pipe->nslots = 2 * depth;
+    pthread_mutex_init(&pipe->lock, NULL);
+    pthread_cond_init(&pipe->cond, NULL);
+    pipe->slots = calloc(pipe->nslots, sizeof(rkusb_slot));
+    pipe->free.q = calloc(pipe->nslots, sizeof(rkusb_slot *));
+    pipe->ready.q = calloc(pipe->nslots, sizeof(rkusb_slot *));
+    pipe->done.q = calloc(pipe->nslots, sizeof(rkusb_slot *));
+    if (!pipe->slots || !pipe->free.q || !pipe->ready.q || !pipe->done.q)
+        goto fail;
+
+    for (int i = 0; i < pipe->nslots; i++) {
+        rkusb_slot *slot = &pipe->slots[i];
+        slot->pipe = pipe;
+        slot->tag = (uint32_t)i << 24;
+        if (!(slot->buf = rkusb_buf_alloc(device->blocksize)))
+            goto fail;
+        for (int j = 0; j < 3; j++)
+            if (!(slot->xfer[j] = libusb_alloc_transfer(0)))
+                goto fail;
+    }
+    return pipe;
+
+fail:
+    rkusb_pipe_free(pipe);
+    return NULL;
+}
+
+void rkusb_pipe_free(rkusb_pipe *pipe) {
+    if (!pipe) return;
+    for (int i = 0; pipe->slots && i < pipe->nslots; i++) {
+        for (int j = 0; j < 3; j++)
+            if (pipe->slots[i].xfer[j])
+                libusb_free_transfer(pipe->slots[i].xfer[j]);
+        rkusb_buf_free(pipe->slots[i].buf);
+        rkusb_buf_free(pipe->slots[i].aux);
+    }
+    pthread_mutex_destroy(&pipe->lock);
+    pthread_cond_destroy(&pipe->cond);
+    free(pipe->free.q);
+    free(pipe->ready.q);
+    free(pipe->done.q);
+    free(pipe->slots);
+    free(pipe);
+}
+
+/* runs the three stages until the producer is exhausted; 0 on success */
+int rkusb_pipe_run(rkusb_pipe *pipe, rkusb_stage produce, rkusb_stage consume, void *ctx) {
+    pthread_t producer, consumer;
+    int consuming = 0;
+    struct timeval tv = { 1, 0 };
+    rkusb_slot *slot;
+
+    pipe->produce = produce;
+    pipe->consume = consume;
+    pipe->ctx = ctx;
+    pipe->error = pipe->inflight = pipe->busy = 0;
+    pipe->free.head = pipe->ready.head = pipe->done.head = 0;
+    pipe->free.closed = pipe->ready.closed = pipe->done.closed = 0;
+    pipe->ready.count = pipe->done.count = 0;
+    pipe->free.count = pipe->nslots;
+    for (int i = 0; i < pipe->nslots; i++)
+        pipe->free.q[i] = &pipe->slots[i];
+
+    if (pthread_create(&producer, NULL, rkusb_pipe_producer, pipe))
+        return LIBUSB_ERROR_NO_MEM;
+    if (consume && pthread_create(&consumer, NULL, rkusb_pipe_consumer, pipe))
+        rkusb_pipe_fail(pipe, LIBUSB_ERROR_NO_MEM);     /* stops the producer */
+    else
+        consuming = consume != NULL;
+
+    for (;;) {
+        pthread_mutex_lock(&pipe->lock);
+        if (pipe->error) {
+            pthread_mutex_unlock(&pipe->lock);
+            break;
+        }
+        if (pipe->inflight < pipe->depth && pipe->ready.count) {
+            slot = pipe->ready.q[pipe->ready.head];
+            pipe->ready.head = (pipe->ready.head + 1) % pipe->nslots;
+            pipe->ready.count--;
+            pthread_mutex_unlock(&pipe->lock);
+            rkusb_pipe_submit(pipe, slot);
+            continue;
+        }
+        if (!pipe->inflight) {
+            /* the consumer may still hand back slots to resubmit */
+            if (pipe->ready.closed && !pipe->ready.count && !pipe->busy) {
+                pthread_mutex_unlock(&pipe->lock);
+                break;
+            }
+            /* nothing on the bus: wait for the producer */
+            pthread_cond_wait(&pipe->cond, &pipe->lock);
+            pthread_mutex_unlock(&pipe->lock);
+            continue;
+        }
+        pthread_mutex_unlock(&pipe->lock);
+        libusb_handle_events_timeout_completed(pipe->device->usb_ctx, &tv, NULL);
+    }
+
+    /* on error, take back whatever is still on the bus */
+    for (int i = 0; i < pipe->nslots; i++)
+        if (pipe->slots[i].pending)
+            for (int j = 0; j < 3; j++)
+                libusb_cancel_transfer(pipe->slots[i].xfer[j]);
+    while (pipe->inflight)
+        libusb_handle_events_timeout_completed(pipe->device->usb_ctx, &tv, NULL);
+
+    rkusb_queue_close(pipe, &pipe->done);
+    pthread_join(producer, NULL);
+    if (consuming) pthread_join(consumer, NULL);
+
+    return pipe->error;
+}
+
+typedef struct {
+    rkusb_stage consume;
+    void *ctx;
+    uint32_t offset, end, incr;
+} rkusb_read_job;
+
+static int rkusb_read_next(void *ctx, rkusb_slot *slot) {
+    rkusb_read_job *job = ctx;
+    uint32_t n = job->end - job->offset;
+
+    if (!n) return 0;
+    if (n > job->incr) n = job->incr;
+    rkusb_slot_cmd(slot, RKFT_CMD_READLBA, job->offset, n);
+    job->offset += n;
+    return 1;
+}
+
+static int rkusb_read_done(void *ctx, rkusb_slot *slot) {
+    rkusb_read_job *job = ctx;
+    return job->consume(job->ctx, slot);
+}
+
+/* one-shot pipe: new, run, free */
+int rkusb_pipe_exec(rkusb_device *device, int depth, rkusb_stage produce, rkusb_stage consume, void *ctx) {
+    rkusb_pipe *pipe = rkusb_pipe_new(device, depth);
+    int r;
+
+    if (!pipe) return LIBUSB_ERROR_NO_MEM;
+    r = rkusb_pipe_run(pipe, produce, consume, ctx);
+    rkusb_pipe_free(pipe);
+    return r;
+}
+
+/* read nsectors starting at offset, handing every chunk to consume in order */
+int rkusb_pipe_read(rkusb_device *device, int depth, uint32_t offset, uint32_t nsectors,
+                    rkusb_stage consume, void *ctx) {
+    rkusb_read_job job = { consume, ctx, offset, offset + nsectors, device->blocksize >> 9 };
+
+    return rkusb_pipe_exec(device, depth, rkusb_read_next, consume ? rkusb_read_done : NULL, &job);
+}
+
+/* transfer sizes tried by rkusb_pipe_tune, smallest first */
+const uint32_t rkusb_tune_sizes[RKUSB_TUNE_SIZES] = {
+    0x8000, 0x10000, 0x20000, 0x40000, 0x80000, 0x100000, 0x200000, 0
+};
+
+/*
+ * Times a pipelined read of the first nsectors of the flash with every
+ * candidate transfer size and leaves the device on the fastest one.
+ * Probing stops at the first size the loader rejects.  rates, if not NULL,
+ * gets the bytes/s of every size tried, 0 for those that were not.
+ */
+uint32_t rkusb_pipe_tune(rkusb_device *device, int depth, uint32_t nsectors, double *rates) {
+    uint32_t best = device->blocksize;
+    double rate, best_rate = 0, t;
+
+    for (int i = 0; rates && rkusb_tune_sizes[i]; i++)
+        rates[i] = 0;
+    for (int i = 0; rkusb_tune_sizes[i]; i++) {
+        if (rkusb_set_blocksize(device, rkusb_tune_sizes[i]))
+            break;
+        t = rkstats_clock();
+        if (rkusb_pipe_read(device, depth, 0, nsectors, NULL, NULL))
+            break;
+        rate = nsectors / (rkstats_clock() - t);
+        if (rates) rates[i] = rate * 512;
+        if (rate > best_rate) {
+            best_rate = rate;
+            best = device->blocksize;
+        }
+    }
+
+    rkusb_set_blocksize(device, best);
+    return best;
+}
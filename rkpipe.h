@@ -0,0 +1,75 @@
+#ifndef _RKPIPE_H_
+#define _RKPIPE_H_
+
+/*
+ * Pipelined RockUSB transfers.
+ *
+ * Every command is a slot holding the usual command/data/status triple,
+ * submitted as libusb asynchronous transfers.  Up to `depth' slots are kept
+ * in flight so the device never waits for the host between commands.
+ *
+ * A slot travels through three stages:
+ *
+ *   producer thread  ->  USB (caller thread)  ->  consumer thread
+ *
+ * The producer fills in the command (and the data for writes), the caller
+ * thread submits it and handles libusb events, and the consumer gets the
+ * completed slots in submission order.  Both stage callbacks return 1 when
+ * the slot was handled, 0 at the end of the stream and <0 on error.
+ *
+ * Failed slots still reach the consumer, with slot->error set to 1 when the
+ * device rejected the command and -1 when the transfer itself failed, so it
+ * can decide whether to carry on.  Without a consumer any failure stops the
+ * pipe.  A consumer may also turn a slot into a new command and return
+ * RKUSB_STAGE_AGAIN to have it submitted again, e.g. to write back a chunk
+ * it just read.
+ *
+ * rkusb_pipe_new returns NULL when out of memory, and running a pipe
+ * returns LIBUSB_ERROR_NO_MEM when it cannot be set up or its threads
+ * cannot be started; otherwise 0 or the error a stage or the USB side
+ * stopped it with.
+ */
+
+#include "rkusb.h"
+
+#define RKFT_QUEUE_DEPTH    4       /* commands in flight by default */
+#define RKFT_QUEUE_MAX      64
+
+#define RKUSB_STAGE_AGAIN   2       /* consumer: submit the slot once more */
+
+typedef struct rkusb_pipe rkusb_pipe;
+
+typedef struct {
+    rkusb_pipe *pipe;
+    struct libusb_transfer *xfer[3];    /* command, data, status */
+    uint8_t cmd[31], res[13];
+    uint8_t *buf, *aux;                 /* aux: see rkusb_slot_aux */
+    uint32_t command, offset, nsectors, length;
+    uint32_t crc;                       /* crc and tries are free for the */
+    int tries;                          /* stages, cleared for new commands */
+    int pending, error, partial;
+    uint32_t tag;                       /* of the last command block */
+    double start;                       /* submitted, for --stats */
+} rkusb_slot;
+
+typedef int (*rkusb_stage)(void *ctx, rkusb_slot *slot);
+
+void rkusb_slot_cmd(rkusb_slot *slot, uint32_t command, uint32_t offset, uint16_t nsectors);
+uint8_t *rkusb_slot_aux(rkusb_slot *slot);
+void rkusb_slot_swap(rkusb_slot *slot);
+void *rkusb_buf_alloc(size_t size);
+void rkusb_buf_free(void *p);
+
+rkusb_pipe *rkusb_pipe_new(rkusb_device *device, int depth);
+void rkusb_pipe_free(rkusb_pipe *pipe);
+int rkusb_pipe_run(rkusb_pipe *pipe, rkusb_stage produce, rkusb_stage consume, void *ctx);
+int rkusb_pipe_exec(rkusb_device *device, int depth, rkusb_stage produce, rkusb_stage consume, void *ctx);
+int rkusb_pipe_read(rkusb_device *device, int depth, uint32_t offset, uint32_t nsectors,
+                    rkusb_stage consume, void *ctx);
+
+#define RKUSB_TUNE_SIZES    8       /* rkusb_tune_sizes, 0 terminated */
+
+extern const uint32_t rkusb_tune_sizes[RKUSB_TUNE_SIZES];
+uint32_t rkusb_pipe_tune(rkusb_device *device, int depth, uint32_t nsectors, double *rates);
+
+#endif /* !_RKPIPE_H_ */
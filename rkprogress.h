@@ -0,0 +1,129 @@
+#ifndef _RKPROGRESS_H_
+#define _RKPROGRESS_H_
+
+/*
+ * Progress of long transfers (--progress).
+ *
+ * The stages report where they got to as often as they like; a line is
+ * only written every RKPROGRESS_INTERVAL seconds and once at the end of
+ * each phase.  The line goes to fd in one write, either for people ("\r"
+ * and overwritten in place, left out in -m workers) or as a JSON object
+ * per line for whatever drives rkflashtool or rkflashd:
+ *
+ *   {"device": "1-2", "what": "writing", "done": 1048576, "total": 8388608,
+ *    "rate": 31457280, "avg": 30146560, "elapsed": 0.035, "eta": 0.24, "final": false}
+ *
+ * rate and avg are in bytes/s, the rate since the previous line and since
+ * the start; eta is null until there is a rate to go by.  rkflashd adds
+ * "job" with the id of the job the line is about, and takes the lines
+ * through send to put them on its client connections itself.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "rkinfo.h"
+#include "rkstats.h"
+
+#define RKPROGRESS_INTERVAL 0.25        /* seconds between lines */
+
+#define RKPROGRESS_NONE     0
+#define RKPROGRESS_HUMAN    1
+#define RKPROGRESS_JSON     2
+
+typedef struct {
+    int mode, fd;
+    int job;                            /* > 0: labels the JSON lines */
+    void (*send)(void *ctx, const char *line, int len);    /* instead of fd, if set */
+    void *ctx;
+    pthread_mutex_t lock;
+    const char *device, *what;
+    uint32_t start;                     /* sector the phase starts at */
+    uint64_t done, total;               /* bytes */
+    uint64_t done_last;                 /* done at the previous line */
+    double t0, t_last;
+} rkprogress;
+
+static void rkprogress_emit(rkprogress *p, int final) {
+    double now = rkstats_clock(), elapsed = now - p->t0, dt = now - p->t_last;
+    double avg = elapsed > 0 ? p->done / elapsed : 0;
+    double rate = dt > 0 ? (p->done - p->done_last) / dt : 0;
+    double eta = avg > 0 && p->total > p->done ? (p->total - p->done) / avg : 0;
+    char line[512];
+    int len = 0;
+
+    if (p->mode == RKPROGRESS_JSON) {
+        if (p->job > 0)
+            len = snprintf(line, sizeof(line), "{\"job\": %d, ", p->job);
+        else
+            len = snprintf(line, sizeof(line), "{");
+        len += snprintf(line + len, sizeof(line) - len, "\"device\": \"%s\", \"what\": \"%s\", "
+                        "\"done\": %llu, \"total\": %llu, \"rate\": %.0f, \"avg\": %.0f, "
+                        "\"elapsed\": %.3f, \"eta\": ",
+                        p->device, p->what, (unsigned long long)p->done,
+                        (unsigned long long)p->total, final ? avg : rate, avg, elapsed);
+        if (avg > 0 || final)
+            len += snprintf(line + len, sizeof(line) - len, "%.2f", eta);
+        else
+            len += snprintf(line + len, sizeof(line) - len, "null");
+        len += snprintf(line + len, sizeof(line) - len, ", \"final\": %s}\n", final ? "true" : "false");
+    } else {
+        if (!info_progress) return;
+        len = snprintf(line, sizeof(line), "\r%sinfo: %s %8.1f/%.1f MiB %3d%% %7.1f MB/s, avg %.1f MB/s",
+                       info_prefix, p->what, p->done / 1048576.0, p->total / 1048576.0,
+                       p->total ? (int)(p->done * 100 / p->total) : 100,
+                       (final ? avg : rate) / 1e6, avg / 1e6);
+        if (!final && avg > 0)
+            len += snprintf(line + len, sizeof(line) - len, ", %d:%02d left",
+                            (int)eta / 60, (int)eta % 60);
+        len += snprintf(line + len, sizeof(line) - len, final ? "            \n" : "    ");
+    }
+    if (p->send)
+        p->send(p->ctx, line, len);
+    else if (write(p->fd, line, len) != len)
+        p->mode = RKPROGRESS_NONE;
+    p->done_last = p->done;
+    p->t_last = now;
+}
+
+/* a phase of what over the sectors [start, end) begins */
+static void rkprogress_start(rkprogress *p, const char *device, const char *what,
+                             uint32_t start, uint32_t end) {
+    pthread_mutex_lock(&p->lock);
+    p->device = device;
+    p->what = what;
+    p->start = start;
+    p->total = (uint64_t)(end - start) * 512;
+    p->done = p->done_last = 0;
+    p->t0 = p->t_last = rkstats_clock();
+    pthread_mutex_unlock(&p->lock);
+}
+
+/* moves done to the sector end, or on by nsectors if end is 0 */
+static void rkprogress_update(rkprogress *p, uint32_t end, uint32_t nsectors) {
+    uint64_t done;
+
+    if (p->mode == RKPROGRESS_NONE) return;
+    pthread_mutex_lock(&p->lock);
+    if (end)
+        done = end > p->start ? (uint64_t)(end - p->start) * 512 : 0;
+    else
+        done = p->done + (uint64_t)nsectors * 512;
+    if (done > p->total) done = p->total;
+    if (done > p->done) p->done = done;
+    if (rkstats_clock() - p->t_last >= RKPROGRESS_INTERVAL)
+        rkprogress_emit(p, 0);
+    pthread_mutex_unlock(&p->lock);
+}
+
+/* the phase is over: a last line with what was done */
+static void rkprogress_finish(rkprogress *p) {
+    if (p->mode == RKPROGRESS_NONE) return;
+    pthread_mutex_lock(&p->lock);
+    rkprogress_emit(p, 1);
+    pthread_mutex_unlock(&p->lock);
+}
+
+#endif /* !_RKPROGRESS_H_ */
@@ -0,0 +1,35 @@
+#ifndef _RKSPARSE_H_
+#define _RKSPARSE_H_
+
+/* Android sparse image (simg) format, as written by img2simg/make_ext4fs */
+
+#define SPARSE_HEADER_MAGIC     0xed26ff3a
+#define SPARSE_MAJOR_VERSION    1
+
+#define CHUNK_TYPE_RAW          0xcac1
+#define CHUNK_TYPE_FILL         0xcac2
+#define CHUNK_TYPE_DONT_CARE    0xcac3
+#define CHUNK_TYPE_CRC32        0xcac4
+
+#pragma pack(1)
+typedef struct {
+	uint32_t    magic;
+	uint16_t    major_version;
+	uint16_t    minor_version;
+	uint16_t    file_hdr_sz;
+	uint16_t    chunk_hdr_sz;
+	uint32_t    blk_sz;         /* bytes per block, multiple of 4 */
+	uint32_t    total_blks;     /* blocks in the expanded image */
+	uint32_t    total_chunks;
+	uint32_t    image_checksum;
+} sparse_header;
+
+typedef struct {
+	uint16_t    chunk_type;
+	uint16_t    reserved1;
+	uint32_t    chunk_sz;       /* in blocks of the expanded image */
+	uint32_t    total_sz;       /* in bytes, header included */
+} sparse_chunk_header;
+#pragma pack()
+
+#endif
@@ -0,0 +1,110 @@
+/* rkstats - counters and the --stats report, see rkstats.h */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "rkstats.h"
+
+double rkstats_clock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* error: 0 done, 1 rejected by the device, -1 failed in libusb */
+void rkstats_add(rkstats_entry *e, double start, double end, uint64_t bytes,
+                        int error, int partial) {
+    double t = end - start;
+    uint64_t us = t * 1e6;
+    int b = 0;
+
+    while (us && b < RKSTATS_BUCKETS - 1) {
+        us >>= 1;
+        b++;
+    }
+    if (!e->count || t < e->min) e->min = t;
+    if (!e->count || start < e->first) e->first = start;
+    if (t > e->max) e->max = t;
+    if (end > e->last) e->last = end;
+    e->count++;
+    e->bytes += bytes;
+    e->total += t;
+    e->hist[b]++;
+    if (error > 0) e->rejected++;
+    if (error < 0) e->failed++;
+    if (partial) e->partial++;
+}
+
+/* upper bound of the bucket holding quantile q, at most the maximum, in seconds */
+double rkstats_quantile(const rkstats_entry *e, double q) {
+    uint64_t n = 0, want = q * e->count;
+    int b;
+
+    for (b = 0; b < RKSTATS_BUCKETS - 1; b++)
+        if ((n += e->hist[b]) > want) break;
+    if (b == RKSTATS_BUCKETS - 1 || (1u << b) / 1e6 > e->max)
+        return e->max;
+    return (1u << b) / 1e6;
+}
+
+/*
+ * Prints the n entries named by names, skipping unused ones, to fp: a table
+ * with every line starting with prefix, or with json a single line object
+ * labelled with device.  MB/s is over the time from the first to the last
+ * command of a type, so with commands in flight it is the throughput the
+ * host saw.  Either is written at once so that workers do not interleave.
+ */
+void rkstats_print(FILE *fp, const char *prefix, const rkstats_entry *e,
+                   const char *const *names, int n, int json, const char *device) {
+    char line[16384];
+    size_t len = 0;
+    int i, b, first = 1;
+
+#define RKSTATS_PUT(...) \
+    do { \
+        if (len < sizeof(line)) len += snprintf(line + len, sizeof(line) - len, __VA_ARGS__); \
+    } while (0)
+
+    if (json) {
+        RKSTATS_PUT("{\"device\": \"%s\", \"commands\": {", device);
+        for (i = 0; i < n; i++) {
+            if (!e[i].count) continue;
+            RKSTATS_PUT("%s\"%s\": {\"count\": %llu, \"bytes\": %llu, "
+                        "\"rejected\": %llu, \"failed\": %llu, \"short\": %llu, "
+                        "\"latency_us\": {\"mean\": %.1f, \"min\": %.1f, \"max\": %.1f, "
+                        "\"p50\": %.0f, \"p99\": %.0f}, \"seconds\": %.6f, \"histogram_us\": [",
+                        first ? "" : ", ", names[i],
+                        (unsigned long long)e[i].count, (unsigned long long)e[i].bytes,
+                        (unsigned long long)e[i].rejected, (unsigned long long)e[i].failed,
+                        (unsigned long long)e[i].partial,
+                        e[i].total / e[i].count * 1e6, e[i].min * 1e6, e[i].max * 1e6,
+                        rkstats_quantile(&e[i], 0.5) * 1e6, rkstats_quantile(&e[i], 0.99) * 1e6,
+                        e[i].last - e[i].first);
+            /* counts below 1, 2, 4 ... us, the last bucket open-ended */
+            for (b = 0; b < RKSTATS_BUCKETS; b++)
+                RKSTATS_PUT("%s%u", b ? ", " : "", e[i].hist[b]);
+            RKSTATS_PUT("]}");
+            first = 0;
+        }
+        RKSTATS_PUT("}}\n");
+    } else {
+        RKSTATS_PUT("%s%-14s %8s %10s %8s %5s %5s %5s %9s %9s %9s %9s\n", prefix, "command",
+                    "count", "MiB", "MB/s", "rej", "fail", "short", "avg us", "p50 us", "p99 us",
+                    "max us");
+        for (i = 0; i < n; i++) {
+            double span = e[i].last - e[i].first;
+
+            if (!e[i].count) continue;
+            RKSTATS_PUT("%s%-14s %8llu %10.1f %8.1f %5llu %5llu %5llu %9.0f %9.0f %9.0f %9.0f\n",
+                        prefix, names[i], (unsigned long long)e[i].count, e[i].bytes / 1048576.0,
+                        span > 0 ? e[i].bytes / span / 1e6 : 0.0,
+                        (unsigned long long)e[i].rejected, (unsigned long long)e[i].failed,
+                        (unsigned long long)e[i].partial, e[i].total / e[i].count * 1e6,
+                        rkstats_quantile(&e[i], 0.5) * 1e6, rkstats_quantile(&e[i], 0.99) * 1e6,
+                        e[i].max * 1e6);
+        }
+    }
+#undef RKSTATS_PUT
+    fputs(line, fp);
+}
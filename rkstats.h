@@ -0,0 +1,37 @@
+#ifndef _RKSTATS_H_
+#define _RKSTATS_H_
+
+/*
+ * Per-command counters for --stats.
+ *
+ * A command is accounted once its status phase is over: data bytes, the
+ * time from sending the command block to the end of the status phase,
+ * whether the device rejected it, whether a transfer failed in libusb and
+ * whether the data phase came up short.  Latencies go into a histogram of
+ * power-of-two microsecond buckets, good enough to tell a slow device
+ * (every command slow) from a busy hub or host (a long tail).
+ *
+ * Counters are only updated from the thread that drives libusb, so they
+ * need no locking.  Included by rkusb.h.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define RKSTATS_BUCKETS     25          /* < 1 us, < 2 us, ... < 16 s and above */
+
+typedef struct {
+    uint64_t count, bytes;
+    uint64_t rejected, failed, partial; /* status != 0, libusb error, short data */
+    double total, min, max;             /* latency in seconds */
+    double first, last;                 /* first command sent, last one done */
+    uint32_t hist[RKSTATS_BUCKETS];
+} rkstats_entry;
+
+double rkstats_clock(void);
+void rkstats_add(rkstats_entry *e, double start, double end, uint64_t bytes, int error, int partial);
+double rkstats_quantile(const rkstats_entry *e, double q);
+void rkstats_print(FILE *fp, const char *prefix, const rkstats_entry *e,
+                   const char *const *names, int n, int json, const char *device);
+
+#endif /* !_RKSTATS_H_ */
@@ -13,7 +13,7 @@
 
 #include "version.h"
 #include "rkflashtool.h"
-#include "rkusb.h"
+#include "rkinfo.h"
 
 #ifdef _WIN32       /* hack around non-posix behaviour */
 #undef mkdir
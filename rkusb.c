@@ -0,0 +1,533 @@
+/*
+ * rkusb - RockUSB devices for librkflash, see rkusb.h
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#if RKUSB_MOCK
+#include "rkmock.h"     /* file-backed emulated devices */
+#else
+#include <libusb.h>
+#endif
+#include "rkcrc.h"
+#include "rkusb.h"
+
+#define SETBE16(a, v) do { \
+                        ((uint8_t*)a)[1] =  v      & 0xff; \
+                        ((uint8_t*)a)[0] = (v>>8 ) & 0xff; \
+                      } while(0)
+
+#define SETBE32(a, v) do { \
+                        ((uint8_t*)a)[3] =  v      & 0xff; \
+                        ((uint8_t*)a)[2] = (v>>8 ) & 0xff; \
+                        ((uint8_t*)a)[1] = (v>>16) & 0xff; \
+                        ((uint8_t*)a)[0] = (v>>24) & 0xff; \
+                      } while(0)
+
+static const struct t_pid {
+    uint16_t pid;
+    char name[32];
+    uint8_t idb_version;
+} pidtab[] = {
+    { 0x281a, "RK2818", 1},
+    { 0x290a, "RK2918", 1},
+    { 0x292a, "RK2928", 1},
+    { 0x292c, "RK3026", 1},
+    { 0x300a, "RK3066", 1},
+    { 0x300b, "RK3168", 1},
+    { 0x301a, "RK3036", 1},
+    { 0x310a, "RK3066B", 1},
+    { 0x310b, "RK3188", 1},
+    { 0x310c, "RK312X", 1}, // Both RK3126 and RK3128
+    { 0x310d, "RK3126", 1},
+    { 0x320a, "RK3288", 1},
+    { 0x320b, "RK322X", 1}, // Both RK3228 and RK3229
+    { 0x320c, "RK3228H/RK3318/RK3328", 1},
+    { 0x330a, "RK3368", 1},
+    { 0x330c, "RK3399", 1},
+    { 0, "", 0},
+};
+
+rkstats_entry *rkusb_stats_entry(rkusb_device *device, uint32_t command) {
+    size_t i;
+
+    for (i = 0; i < RKUSB_STATS_TYPES - 1 && rkusb_stats_cmds[i] != command; i++);
+    return &device->stats[i];
+}
+
+/* accounts the synchronous command in progress, if any */
+void rkusb_sync_done(rkusb_device *device) {
+    if (!device->sync.start) return;
+    rkstats_add(rkusb_stats_entry(device, device->sync.command), device->sync.start,
+                rkstats_clock(), device->sync.bytes, device->sync.error, device->sync.partial);
+    device->sync.start = 0;
+}
+
+static void rkusb_sync_begin(rkusb_device *device, uint32_t command) {
+    rkusb_sync_done(device);
+    device->sync.command = command;
+    device->sync.start = rkstats_clock();
+    device->sync.bytes = 0;
+    device->sync.error = device->sync.partial = 0;
+}
+
+/*
+ * Bulk transfer for the synchronous commands: 0 when all len bytes went
+ * through, the libusb error or LIBUSB_ERROR_IO for a short transfer
+ * otherwise.  data counts the bytes towards the command in progress.
+ */
+int rkusb_sync_xfer(rkusb_device *device, unsigned char ep, uint8_t *buf, int len, int data) {
+    int n = 0, r = libusb_bulk_transfer(device->usb_handle, ep, buf, len, &n, device->timeout);
+
+    if (data) device->sync.bytes += n;
+    if (r) {
+        device->sync.error = -1;
+        return r;
+    }
+    if (n != len) {
+        /* only bulk data has a length set by the command, replies to queries vary */
+        if (data && (device->sync.command == RKFT_CMD_READLBA ||
+                     device->sync.command == RKFT_CMD_WRITELBA))
+            device->sync.partial = 1;
+        return LIBUSB_ERROR_IO;
+    }
+    return 0;
+}
+
+int rkusb_send_reset(rkusb_device* device, uint8_t flag) {
+    uint32_t r = ++device->tag;
+    int ret;
+
+    memset(device->cmd, 0 , 31);
+    memcpy(device->cmd, "USBC", 4);
+
+    SETBE32(device->cmd+4, r);
+    SETBE32(device->cmd+12, RKFT_CMD_RESETDEVICE);
+    device->cmd[16] = flag;
+
+    /* the device goes away instead of answering */
+    rkusb_sync_begin(device, RKFT_CMD_RESETDEVICE);
+    ret = rkusb_sync_xfer(device, 2|LIBUSB_ENDPOINT_OUT, device->cmd, sizeof(device->cmd), 0);
+    rkusb_sync_done(device);
+    return ret;
+}
+
+int rkusb_send_exec(rkusb_device* device, uint32_t krnl_addr, uint32_t parm_addr) {
+    uint32_t r = ++device->tag;
+    int ret;
+
+    memset(device->cmd, 0 , 31);
+    memcpy(device->cmd, "USBC", 4);
+
+    if (r)          SETBE32(device->cmd+4, r);
+    if (krnl_addr)  SETBE32(device->cmd+17, krnl_addr);
+    if (parm_addr)  SETBE32(device->cmd+22, parm_addr);
+    SETBE32(device->cmd+12, RKFT_CMD_EXECUTESDRAM);
+
+    rkusb_sync_begin(device, RKFT_CMD_EXECUTESDRAM);
+    ret = rkusb_sync_xfer(device, 2|LIBUSB_ENDPOINT_OUT, device->cmd, sizeof(device->cmd), 0);
+    rkusb_sync_done(device);
+    return ret;
+}
+
+/* tag tells the command blocks apart, the device echoes it in the status */
+void rkusb_fill_cmd(uint8_t *cmd, uint32_t tag, uint32_t command, uint32_t offset, uint16_t nsectors) {
+    memset(cmd, 0 , 31);
+    memcpy(cmd, "USBC", 4);
+
+    if (tag)        SETBE32(cmd+4, tag);
+    if (offset)     SETBE32(cmd+17, offset);
+    if (nsectors)   SETBE16(cmd+22, nsectors);
+    if (command)    SETBE32(cmd+12, command);
+}
+
+/* the send/recv functions return 0 or a libusb error, see rkusb_sync_xfer */
+int rkusb_send_cmd(rkusb_device* device, uint32_t command, uint32_t offset, uint16_t nsectors) {
+    rkusb_fill_cmd(device->cmd, ++device->tag, command, offset, nsectors);
+
+    rkusb_sync_begin(device, command);
+    return rkusb_sync_xfer(device, 2|LIBUSB_ENDPOINT_OUT, device->cmd, sizeof(device->cmd), 0);
+}
+
+int rkusb_recv_res(rkusb_device* device) {
+    int r;
+
+    memset(device->res, 0 , sizeof(device->res));
+    r = rkusb_sync_xfer(device, 1|LIBUSB_ENDPOINT_IN, device->res, sizeof(device->res), 0);
+    if (!r && (memcmp(device->res, "USBS", 4) || device->res[12]) && !device->sync.error)
+        device->sync.error = 1;
+    rkusb_sync_done(device);
+    return r;
+}
+
+/* 0 if the last status block reports success */
+int rkusb_res_status(rkusb_device* device) {
+    return memcmp(device->res, "USBS", 4) || device->res[12];
+}
+
+/* the time left until deadline as transfer timeout, at least 1 ms */
+static void rkusb_timeout_until(rkusb_device *device, double deadline) {
+    double left = (deadline - rkstats_clock()) * 1e3;
+
+    device->timeout = left < 1 ? 1 : (unsigned int)left;
+}
+
+/*
+ * Polls TESTUNITREADY until the loader reports ready, for up to timeout
+ * ms, transfers included: a loader that does not answer at all fails too.
+ */
+int rkusb_wait_ready(rkusb_device* device, int timeout) {
+    double deadline = rkstats_clock() + timeout / 1e3;
+    int r = -1;
+
+    for (;;) {
+        rkusb_timeout_until(device, deadline);
+        if (!rkusb_send_cmd(device, RKFT_CMD_TESTUNITREADY, 0, 0)) {
+            rkusb_timeout_until(device, deadline);
+            if (!rkusb_recv_res(device) && !rkusb_res_status(device)) {
+                r = 0;
+                break;
+            }
+        } else {
+            rkusb_sync_done(device);
+        }
+        if (rkstats_clock() >= deadline) break;
+        usleep(5 * 1000);
+    }
+    device->timeout = 0;
+    return r;
+}
+
+int rkusb_erase_lba(rkusb_device* device, uint32_t offset, uint16_t nsectors) {
+    rkusb_send_cmd(device, RKFT_CMD_ERASE_LBA, offset, nsectors);
+    rkusb_recv_res(device);
+    return rkusb_res_status(device);
+}
+
+int rkusb_send_buf(rkusb_device* device, unsigned int s) {
+    return rkusb_sync_xfer(device, 2|LIBUSB_ENDPOINT_OUT, device->buf, s, 1);
+}
+
+int rkusb_recv_buf(rkusb_device* device, unsigned int s) {
+    memset(device->buf, 0 , device->blocksize);
+    return rkusb_sync_xfer(device, 1|LIBUSB_ENDPOINT_IN, device->buf, s, 1);
+}
+
+/* the loader reports a zero flash id until the usbplug has probed the storage */
+int rkusb_flash_probed(rkusb_device* device) {
+    rkusb_send_cmd(device, RKFT_CMD_READFLASHID, 0, 0);
+    rkusb_recv_buf(device, 5);
+    rkusb_recv_res(device);
+    return memcmp(device->buf, "\0\0\0\0\0", 5) != 0;
+}
+
+void rkusb_disconnect(rkusb_device *device) {
+    if (device) {
+        if (device->usb_handle) {
+            libusb_release_interface(device->usb_handle, 0);
+            libusb_close(device->usb_handle);
+        }
+        if (device->usb_ctx) libusb_exit(device->usb_ctx);
+        free(device->buf);
+    }
+    free(device);
+}
+
+/* size of bulk transfers in bytes; device->buf never shrinks below the default */
+int rkusb_set_blocksize(rkusb_device *device, uint32_t size) {
+    uint8_t *buf;
+
+    if (!size || size % 512 || size > RKFT_BLOCKSIZE_MAX)
+        return -1;
+    if (!(buf = realloc(device->buf, size < RKFT_BLOCKSIZE ? RKFT_BLOCKSIZE : size)))
+        return -1;
+
+    device->buf = buf;
+    device->blocksize = size;
+    return 0;
+}
+
+rkusb_device *rkusb_allocate_device(void) {
+    rkusb_device *device = calloc(1, sizeof(rkusb_device));
+
+    if (device && rkusb_set_blocksize(device, RKFT_BLOCKSIZE)) {
+        free(device);
+        return NULL;
+    }
+    return device;
+}
+
+/* bus-port.port... as in /sys/bus/usb/devices, stable as long as the cabling is */
+static void rkusb_usb_path(libusb_device *dev, char *path) {
+    uint8_t ports[7];
+    int n = libusb_get_port_numbers(dev, ports, sizeof(ports));
+
+    path += sprintf(path, "%d", libusb_get_bus_number(dev));
+    for (int i = 0; i < n; i++)
+        path += sprintf(path, "%c%d", i ? '.' : '-', ports[i]);
+}
+
+static const struct t_pid *rkusb_find_pid(struct libusb_device_descriptor *desc) {
+    const struct t_pid *ppid;
+
+    if (desc->idVendor != 0x2207)
+        return NULL;
+    for (ppid = pidtab; ppid->pid; ppid++)
+        if (desc->idProduct == ppid->pid)
+            return ppid;
+    return NULL;
+}
+
+/* paths of the connected Rockchip devices in mode (0 for any), at most max of them */
+int rkusb_list_devices(char (*paths)[RKUSB_PATH_MAX], int max, uint16_t mode) {
+    struct libusb_device_descriptor desc;
+    libusb_context *ctx;
+    libusb_device **list = NULL;
+    ssize_t count;
+    int n = 0;
+
+    if (libusb_init(&ctx)) return -1;
+    count = libusb_get_device_list(ctx, &list);
+    for (ssize_t idx = 0; idx < count && n < max; ++idx) {
+        libusb_get_device_descriptor(list[idx], &desc);
+        if (rkusb_find_pid(&desc) && (!mode || desc.bcdUSB == mode))
+            rkusb_usb_path(list[idx], paths[n++]);
+    }
+    if (count >= 0) libusb_free_device_list(list, 1);
+    libusb_exit(ctx);
+    return n;
+}
+
+/*
+ * Opens the Rockchip device at path, or the first one found when path is
+ * NULL, into *pdevice; 0 or a libusb error, LIBUSB_ERROR_NO_DEVICE when
+ * there is no such device and e.g. LIBUSB_ERROR_BUSY when another program
+ * has claimed it.
+ */
+int rkusb_open_path(rkusb_device **pdevice, const char *path) {
+    struct libusb_device_descriptor desc;
+    libusb_device **list = NULL;
+    ssize_t count;
+    const struct t_pid *ppid;
+    int r;
+
+    rkusb_device *device = rkusb_allocate_device();
+
+    *pdevice = NULL;
+    if (!device) return LIBUSB_ERROR_NO_MEM;
+
+    /* Initialize libusb */
+    if ((r = libusb_init(&device->usb_ctx))) {
+        device->usb_ctx = NULL;
+        rkusb_disconnect(device);
+        return r;
+    }
+
+    libusb_set_option(device->usb_ctx, LIBUSB_OPTION_LOG_LEVEL, LIBUSB_LOG_LEVEL_INFO );
+
+    /* Detect connected RockChip device */
+    device->usb_handle = 0;
+
+    count = libusb_get_device_list(device->usb_ctx, &list);
+
+    for (ssize_t idx = 0; idx < count && !device->usb_handle; ++idx) {
+        libusb_device *dev = list[idx];
+        libusb_get_device_descriptor(dev, &desc);
+        if (!(ppid = rkusb_find_pid(&desc)))
+            continue;
+        rkusb_usb_path(dev, device->path);
+        if (path && strcmp(path, device->path))
+            continue;
+        if (!libusb_open(dev, &device->usb_handle)) {
+            device->vid = 0x2207;
+            device->pid = ppid->pid;
+            device->soc = ppid->name;
+            device->idb_version = ppid->idb_version;
+            device->mode = desc.bcdUSB;
+        }
+    }
+
+    if (count >= 0) libusb_free_device_list(list, 1);
+
+    if (!device->usb_handle) {
+        rkusb_disconnect(device);
+        return LIBUSB_ERROR_NO_DEVICE;
+    }
+
+    /* Connect to device */
+    if (libusb_kernel_driver_active(device->usb_handle, 0) == 1)
+        libusb_detach_kernel_driver(device->usb_handle, 0);
+
+    if ((r = libusb_claim_interface(device->usb_handle, 0)) < 0) {
+        libusb_close(device->usb_handle);
+        device->usb_handle = NULL;
+        rkusb_disconnect(device);
+        return r;
+    }
+
+    *pdevice = device;
+    return 0;
+}
+
+/* rkusb_open_path, NULL on any error */
+rkusb_device *rkusb_connect_path(const char *path) {
+    rkusb_device *device;
+
+    rkusb_open_path(&device, path);
+    return device;
+}
+
+/*
+ * Once the usbplug starts, the device drops off the bus and comes back at
+ * the same path.  Waits for both, for up to timeout ms, and opens it again.
+ * If it is never seen gone within a second it is assumed to have been too
+ * quick for us.
+ */
+rkusb_device *rkusb_reconnect(const char *path, int timeout) {
+    char paths[RKFT_DEVICES_MAX][RKUSB_PATH_MAX];
+    rkusb_device *device;
+    double start = rkstats_clock();
+    int gone = 0, n, i;
+
+    /* listing is a libusb_init and a full enumeration, it counts as well */
+    do {
+        n = rkusb_list_devices(paths, RKFT_DEVICES_MAX, 0);
+        for (i = 0; i < n && strcmp(paths[i], path); i++);
+        if (i == n)
+            gone = 1;
+        else if ((gone || rkstats_clock() - start >= 1) && (device = rkusb_connect_path(path)))
+            return device;
+        usleep(10 * 1000);
+    } while ((rkstats_clock() - start) * 1e3 < timeout);
+    return NULL;
+}
+
+rkusb_device *rkusb_connect_device(void) {
+    return rkusb_connect_path(NULL);
+}
+
+typedef struct {
+    uint16_t mode;
+    rkusb_arrival arrived;
+    void *ctx;
+    int stop;
+} rkusb_watcher;
+
+static int LIBUSB_CALL rkusb_watch_cb(libusb_context *usb_ctx, libusb_device *dev,
+                                      libusb_hotplug_event event, void *user_data) {
+    rkusb_watcher *w = user_data;
+    struct libusb_device_descriptor desc;
+    char path[RKUSB_PATH_MAX];
+
+    (void)usb_ctx; (void)event;
+    if (w->stop || libusb_get_device_descriptor(dev, &desc) || !rkusb_find_pid(&desc))
+        return 0;
+    if (w->mode && desc.bcdUSB != w->mode)
+        return 0;
+    rkusb_usb_path(dev, path);
+    w->stop = w->arrived(w->ctx, path);
+    return w->stop;
+}
+
+/*
+ * Calls arrived with the path of every Rockchip device in mode (0 for any)
+ * that shows up, those already connected first, until it returns nonzero.
+ * Uses libusb hotplug events, or polls where they are not available.
+ */
+int rkusb_watch(uint16_t mode, rkusb_arrival arrived, void *ctx) {
+    char seen[RKFT_DEVICES_MAX][RKUSB_PATH_MAX], now[RKFT_DEVICES_MAX][RKUSB_PATH_MAX];
+    rkusb_watcher w = { mode, arrived, ctx, 0 };
+    libusb_context *usb_ctx;
+    int nseen = 0, n, i, j, r;
+
+    if (libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+        if (libusb_init(&usb_ctx)) return -1;
+        if (libusb_hotplug_register_callback(usb_ctx, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED,
+                                             LIBUSB_HOTPLUG_ENUMERATE, 0x2207,
+                                             LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY,
+                                             rkusb_watch_cb, &w, NULL)) {
+            libusb_exit(usb_ctx);
+            return -1;
+        }
+        while (!w.stop) {
+            r = libusb_handle_events(usb_ctx);
+            if (r && r != LIBUSB_ERROR_INTERRUPTED) break;
+        }
+        libusb_exit(usb_ctx);
+        return w.stop ? 0 : -1;
+    }
+
+    for (;;) {
+        if ((n = rkusb_list_devices(now, RKFT_DEVICES_MAX, mode)) < 0) return -1;
+        for (i = 0; i < n; i++) {
+            for (j = 0; j < nseen && strcmp(now[i], seen[j]); j++);
+            if (j == nseen && arrived(ctx, now[i])) return 0;
+        }
+        memcpy(seen, now, sizeof(seen));
+        nseen = n;
+        usleep(100 * 1000);
+    }
+}
+
+long rkusb_file_size(FILE *fp) {
+    long sz = 0;
+
+    fseek(fp, 0L, SEEK_END);
+    sz = ftell(fp);
+    fseek(fp, 0L, SEEK_SET);
+
+    return sz;
+}
+
+/* bytes rkusb_prepare_vendor_code makes of bin_size bytes of code */
+uint32_t rkusb_vendor_code_size(uint32_t bin_size) {
+    return (bin_size + 2047) / 2048 * 2048 + 2;
+}
+
+/*
+ * Pads bin to 2 KiB, scrambles it and appends the CRC16 the boot ROM
+ * checks, into buf of rkusb_vendor_code_size(bin_size) bytes; returns the
+ * size.
+ */
+uint32_t rkusb_prepare_vendor_code(uint8_t *buf, const uint8_t *bin, uint32_t bin_size) {
+    uint32_t size = rkusb_vendor_code_size(bin_size) - 2;
+    uint16_t crc16 = 0xffff;
+
+    memcpy(buf, bin, bin_size);
+    memset(buf + bin_size, 0, size - bin_size);
+    rkrc4(buf, size);
+    crc16 = rkcrc16(crc16, buf, size);
+    buf[size++] = crc16 >> 8;
+    buf[size++] = crc16 & 0xff;
+
+    return size;
+}
+
+/* --stats at the end of a run: a table with prefix on every line, or a line of JSON */
+void rkusb_print_stats(rkusb_device *device, FILE *fp, const char *prefix, int json) {
+    rkusb_sync_done(device);
+    rkstats_print(fp, prefix, device->stats, rkusb_stats_names, RKUSB_STATS_TYPES, json, device->path);
+}
+
+/* uploads size bytes in 4 KiB control transfers; 0 or the first libusb error */
+int rkusb_send_vendor_code(rkusb_device* device, const uint8_t *buffs, int size, int code) {
+    rkstats_entry *e = rkusb_stats_entry(device, RKUSB_STATS_VENDOR);
+    int n, r;
+    double t;
+
+    rkusb_sync_done(device);
+    while (size > 0) {
+        n = size > 4096 ? 4096 : size;
+        t = rkstats_clock();
+        r = libusb_control_transfer(device->usb_handle, LIBUSB_REQUEST_TYPE_VENDOR, 12, 0, code,
+                                    (uint8_t *)buffs, n, 0);
+        rkstats_add(e, t, rkstats_clock(), r > 0 ? r : 0, r < 0 ? -1 : 0, r >= 0 && r != n);
+        if (r < 0) return r;
+        if (r != n) return LIBUSB_ERROR_IO;
+        buffs += n;
+        size -= n;
+    }
+    return 0;
+}
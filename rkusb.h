@@ -1,38 +1,42 @@
 #ifndef _RKUSB_H_
 #define _RKUSB_H_
 
-#include <stdio.h>
-#include <stdlib.h>
-#include <stdarg.h>
-#include <string.h>
-#include <libusb.h>
-#include "rkcrc.h"
-
-static const char *const strings[2] = { "info", "fatal" };
+/*
+ * RockUSB devices, the synchronous half of librkflash.
+ *
+ * Every rkusb_device has a libusb context of its own, so devices can be
+ * driven from separate threads; one device from one thread at a time.
+ * Nothing here prints or exits: functions return 0 or a libusb error
+ * (NULL for the constructors) and leave reporting to the caller.  rkflash.h
+ * has the stable, opaque interface on top of this one.
+ */
 
-static void info_and_fatal(const int s, const int cr, char *f, ...) {
-    va_list ap;
-    va_start(ap,f);
-    fprintf(stderr, "%s%s: ", cr ? "\r" : "", strings[s]);
-    vfprintf(stderr, f, ap);
-    va_end(ap);
-    if (s) exit(s);
-}
+#include <stdio.h>
+#include <stdint.h>
+#include "rkstats.h"
 
-#define info(...)    info_and_fatal(0, 0, __VA_ARGS__)
-#define infocr(...)  info_and_fatal(0, 1, __VA_ARGS__)
-#define fatal(...)   info_and_fatal(1, 0, __VA_ARGS__)
+struct libusb_context;
+struct libusb_device_handle;
 
 #define RKFT_USB_MODE_MASKROM   0x200
 #define RKFT_USB_MODE_LOADER    0x201
 
-#define RKFT_BLOCKSIZE		0x8000      /* must be multiple of 512 */
+#define RKUSB_PATH_MAX          32      /* "bus-port.port..." with up to 7 ports */
+#define RKFT_DEVICES_MAX        64      /* devices driven at once with -m */
+#define RKFT_READY_TIMEOUT      1000    /* ms for the loader to answer TESTUNITREADY */
+#define RKFT_REENUM_TIMEOUT     10000   /* ms for a device to come back after usbplug */
+
+#define RKFT_BLOCKSIZE		0x8000      /* default transfer size, must be multiple of 512 */
+#define RKFT_BLOCKSIZE_MAX	0x1000000   /* keeps nsectors within 16 bits */
 #define RKFT_RKPARAM_BLOCKSIZE	0x400      /* must be multiple of 512 */
 #define RKFT_IDB_DATASIZE	0x200
 #define RKFT_IDB_BLOCKSIZE	0x210
 #define RKFT_IDB_INCR		0x20
 #define RKFT_MEM_INCR		0x80
 #define RKFT_OFF_INCR		(RKFT_BLOCKSIZE >> 9)
+#define RKFT_ERASE_INCR		0x8000      /* sectors per ERASE_LBA command */
+#define RKFT_BLANK_GRAIN	0x40        /* sectors classified at a time when flashing with -B */
+#define RKFT_VERIFY_RETRIES	2           /* rewrites of a chunk that fails verification */
 #define MAX_PARAM_LENGTH	(RKFT_RKPARAM_BLOCKSIZE - 12) /* cf. MAX_LOADER_PARAM in rkloader */
 #define SDRAM_BASE_ADDRESS	0x60000000
 
@@ -69,41 +73,21 @@ static void info_and_fatal(const int s, const int cr, char *f, ...) {
 #define RKFT_CMD_LOWERFORMAT        0x0000001c
 #define RKFT_CMD_WRITENKB           0x00000030
 
-#define SETBE16(a, v) do { \
-                        ((uint8_t*)a)[1] =  v      & 0xff; \
-                        ((uint8_t*)a)[0] = (v>>8 ) & 0xff; \
-                      } while(0)
-
-#define SETBE32(a, v) do { \
-                        ((uint8_t*)a)[3] =  v      & 0xff; \
-                        ((uint8_t*)a)[2] = (v>>8 ) & 0xff; \
-                        ((uint8_t*)a)[1] = (v>>16) & 0xff; \
-                        ((uint8_t*)a)[0] = (v>>24) & 0xff; \
-                      } while(0)
+#define RKUSB_STATS_VENDOR          0           /* vendor control transfers (ddrinit, usbplug) */
 
-static struct t_pid {
-    uint16_t pid;
-    char name[32];
-    uint8_t idb_version;
-} pidtab[] = {
-    { 0x281a, "RK2818", 1},
-    { 0x290a, "RK2918", 1},
-    { 0x292a, "RK2928", 1},
-    { 0x292c, "RK3026", 1},
-    { 0x300a, "RK3066", 1},
-    { 0x300b, "RK3168", 1},
-    { 0x301a, "RK3036", 1},
-    { 0x310a, "RK3066B", 1},
-    { 0x310b, "RK3188", 1},
-    { 0x310c, "RK312X", 1}, // Both RK3126 and RK3128
-    { 0x310d, "RK3126", 1},
-    { 0x320a, "RK3288", 1},
-    { 0x320b, "RK322X", 1}, // Both RK3228 and RK3229
-    { 0x320c, "RK3228H/RK3318/RK3328", 1},
-    { 0x330a, "RK3368", 1},
-    { 0x330c, "RK3399", 1},
-    { 0, "", 0},
+/* command types told apart by --stats, the last entry takes the rest */
+static const uint32_t rkusb_stats_cmds[] = {
+    RKFT_CMD_TESTUNITREADY, RKFT_CMD_READFLASHID, RKFT_CMD_READFLASHINFO,
+    RKFT_CMD_READCHIPINFO, RKFT_CMD_READLBA, RKFT_CMD_WRITELBA, RKFT_CMD_ERASE_LBA,
+    RKFT_CMD_ERASEFORCE, RKFT_CMD_RESETDEVICE, RKFT_CMD_EXECUTESDRAM, RKUSB_STATS_VENDOR,
 };
+static const char *const rkusb_stats_names[] = {
+    "TESTUNITREADY", "READFLASHID", "READFLASHINFO",
+    "READCHIPINFO", "READLBA", "WRITELBA", "ERASE_LBA",
+    "ERASEFORCE", "RESETDEVICE", "EXECUTESDRAM", "VENDOR",
+    "other",
+};
+#define RKUSB_STATS_TYPES   (sizeof(rkusb_stats_names) / sizeof(rkusb_stats_names[0]))
 
 typedef struct {
     uint32_t flash_size;
@@ -119,12 +103,24 @@ typedef struct {
     uint16_t vid;
     uint16_t pid;
     uint8_t  idb_version;
-    char* soc;
+    const char *soc;
     uint16_t mode;
     nand_info *nand;
-    libusb_context *usb_ctx;
-    libusb_device_handle *usb_handle;
-    uint8_t cmd[31], res[13], buf[RKFT_BLOCKSIZE];
+    struct libusb_context *usb_ctx;
+    struct libusb_device_handle *usb_handle;
+    uint32_t blocksize;
+    uint8_t cmd[31], res[13], *buf;
+    uint32_t tag;                       /* of the last command block sent */
+    unsigned int timeout;               /* ms per synchronous transfer, 0 waits forever */
+    char path[RKUSB_PATH_MAX];
+    uint64_t nbytes;                    /* moved by pipelined transfers */
+    rkstats_entry stats[RKUSB_STATS_TYPES];
+    struct {                            /* synchronous command being accounted */
+        uint32_t command;
+        double start;
+        uint64_t bytes;
+        int error, partial;
+    } sync;
 } rkusb_device;
 
 static const char* const manufacturer[] = {   /* NAND Manufacturers */
@@ -139,166 +135,39 @@ static const char* const manufacturer[] = {   /* NAND Manufacturers */
     "SanDisk",
 };
 #define MAX_NAND_ID (sizeof manufacturer / sizeof(char *))
-static int tmp;
-
-void rkusb_send_reset(rkusb_device* device, uint8_t flag) {
-    long int r = rand();
-
-    memset(device->cmd, 0 , 31);
-    memcpy(device->cmd, "USBC", 4);
-
-    SETBE32(device->cmd+4, r);
-    SETBE32(device->cmd+12, RKFT_CMD_RESETDEVICE);
-    device->cmd[16] = flag;
-
-    libusb_bulk_transfer(device->usb_handle, 2|LIBUSB_ENDPOINT_OUT, device->cmd, sizeof(device->cmd), &tmp, 0);
-}
-
-void rkusb_send_exec(rkusb_device* device, uint32_t krnl_addr, uint32_t parm_addr) {
-    long int r = rand();
-
-    memset(device->cmd, 0 , 31);
-    memcpy(device->cmd, "USBC", 4);
-
-    if (r)          SETBE32(device->cmd+4, r);
-    if (krnl_addr)  SETBE32(device->cmd+17, krnl_addr);
-    if (parm_addr)  SETBE32(device->cmd+22, parm_addr);
-    SETBE32(device->cmd+12, RKFT_CMD_EXECUTESDRAM);
-
-    libusb_bulk_transfer(device->usb_handle, 2|LIBUSB_ENDPOINT_OUT, device->cmd, sizeof(device->cmd), &tmp, 0);
-}
-
-void rkusb_send_cmd(rkusb_device* device, uint32_t command, uint32_t offset, uint16_t nsectors) {
-    long int r = rand();
-
-    memset(device->cmd, 0 , 31);        
-    memcpy(device->cmd, "USBC", 4);
-
-    if (r)          SETBE32(device->cmd+4, r);
-    if (offset)     SETBE32(device->cmd+17, offset);
-    if (nsectors)   SETBE16(device->cmd+22, nsectors);
-    if (command)    SETBE32(device->cmd+12, command);
-
-    libusb_bulk_transfer(device->usb_handle, 2|LIBUSB_ENDPOINT_OUT, device->cmd, sizeof(device->cmd), &tmp, 0);
-}
-
-void rkusb_recv_res(rkusb_device* device) {
-    memset(device->res, 0 , sizeof(device->res));
-    libusb_bulk_transfer(device->usb_handle, 1|LIBUSB_ENDPOINT_IN, device->res, sizeof(device->res), &tmp, 0);
-}
-
-void rkusb_send_buf(rkusb_device* device, unsigned int s) {
-    libusb_bulk_transfer(device->usb_handle, 2|LIBUSB_ENDPOINT_OUT, device->buf, s, &tmp, 0);
-}
-
-void rkusb_recv_buf(rkusb_device* device, unsigned int s) {
-    memset(device->buf, 0 , RKFT_BLOCKSIZE);
-    libusb_bulk_transfer(device->usb_handle, 1|LIBUSB_ENDPOINT_IN, device->buf, s, &tmp, 0);
-}
-
-void rkusb_disconnect(rkusb_device *device) {
-    if (device) {
-        libusb_release_interface(device->usb_handle, 0);
-        libusb_close(device->usb_handle);
-    }
-    libusb_exit(device->usb_ctx);
-    free(device);
-}
-
-rkusb_device *rkusb_allocate_device() {
-    return malloc(sizeof(rkusb_device));
-}
-
-rkusb_device *rkusb_connect_device() {
-    struct libusb_device_descriptor desc;
-    libusb_device **list = NULL;
-    size_t count;
-    struct t_pid *ppid = pidtab;
-
-    rkusb_device *device = rkusb_allocate_device();
-
-    /* Initialize libusb */
-    if (libusb_init(&device->usb_ctx)) return NULL; //fatal("cannot init libusb\n");
-
-    libusb_set_option(device->usb_ctx, LIBUSB_OPTION_LOG_LEVEL, LIBUSB_LOG_LEVEL_INFO );
-
-    /* Detect connected RockChip device */
-    device->usb_handle = 0;
-
-    count = libusb_get_device_list(device->usb_ctx, &list);
-
-    for (size_t idx = 0; idx < count; ++idx) {
-        libusb_device *dev = list[idx];
-        libusb_get_device_descriptor(dev, &desc);
-        if (desc.idVendor != 0x2207)
-            continue;
-        while ( !device->usb_handle && ppid->pid ) {
-            if (desc.idProduct == ppid->pid) {
-                if (!libusb_open(dev, &device->usb_handle)) {
-                    //device->usb_handle = dev;
-                    device->vid = 0x2207;
-                    device->pid = ppid->pid;
-                    device->soc = ppid->name;
-                    device->idb_version = ppid->idb_version;
-                    device->mode = desc.bcdUSB;
-                }
-            }
-            ppid++;
-        }
-    }
-
-    libusb_free_device_list(list, count);
-
-    if (!device->usb_handle) return NULL; //fatal("cannot open device\n");
-
-    /* Connect to device */
-    if (libusb_kernel_driver_active(device->usb_handle, 0) == 1) {
-        if (!libusb_detach_kernel_driver(device->usb_handle, 0))
-            info("driver detached");
-    }
-
-    if (libusb_claim_interface(device->usb_handle, 0) < 0)
-        fatal("cannot claim interface\n");
-
-    return device;
-}
-
-long rkusb_file_size(FILE *fp) {
-    long sz = 0;
-
-    fseek(fp, 0L, SEEK_END);
-    sz = ftell(fp);
-    fseek(fp, 0L, SEEK_SET);
-
-    return sz;
-}
-
-int rkusb_prepare_vendor_code(uint8_t **buffs, uint8_t *bin, uint32_t bin_size) {
-    int size;
-    uint16_t crc16 = 0xffff;
-
-    size = ((bin_size % 2048) == 0) ? bin_size :  ((bin_size/2048) + 1) *2048;
-    *buffs = malloc(size + 2); //make room for crc
-    memset (*buffs, 0, size + 2);
-    memcpy (*buffs, bin, bin_size);
-    rkrc4(*buffs, size);
-    crc16 = rkcrc16(crc16, *buffs, size);
-    (*buffs)[size++] = crc16 >> 8;
-    (*buffs)[size++] = crc16 & 0xff;
-    //info("crc calculated %04x\n", crc16);
-
-    return size;
-}
-
-void rkusb_send_vendor_code(rkusb_device* device, uint8_t *buffs, int size, int code) {
-    while (size > 4096) {
-        libusb_control_transfer(device->usb_handle, LIBUSB_REQUEST_TYPE_VENDOR, 12, 0, code, buffs, 4096, 0);
-            buffs += 4096;
-            size -= 4096;
-    }
-    if (size) {
-	libusb_control_transfer(device->usb_handle, LIBUSB_REQUEST_TYPE_VENDOR, 12, 0, code, buffs, size, 0);
-    }
-}
 
-#endif
+rkstats_entry *rkusb_stats_entry(rkusb_device *device, uint32_t command);
+void rkusb_sync_done(rkusb_device *device);
+int rkusb_sync_xfer(rkusb_device *device, unsigned char ep, uint8_t *buf, int len, int data);
+
+void rkusb_fill_cmd(uint8_t *cmd, uint32_t tag, uint32_t command, uint32_t offset, uint16_t nsectors);
+int rkusb_send_reset(rkusb_device *device, uint8_t flag);
+int rkusb_send_exec(rkusb_device *device, uint32_t krnl_addr, uint32_t parm_addr);
+int rkusb_send_cmd(rkusb_device *device, uint32_t command, uint32_t offset, uint16_t nsectors);
+int rkusb_recv_res(rkusb_device *device);
+int rkusb_res_status(rkusb_device *device);
+int rkusb_wait_ready(rkusb_device *device, int timeout);
+int rkusb_erase_lba(rkusb_device *device, uint32_t offset, uint16_t nsectors);
+int rkusb_send_buf(rkusb_device *device, unsigned int s);
+int rkusb_recv_buf(rkusb_device *device, unsigned int s);
+int rkusb_flash_probed(rkusb_device *device);
+
+rkusb_device *rkusb_allocate_device(void);
+int rkusb_set_blocksize(rkusb_device *device, uint32_t size);
+int rkusb_list_devices(char (*paths)[RKUSB_PATH_MAX], int max, uint16_t mode);
+int rkusb_open_path(rkusb_device **pdevice, const char *path);
+rkusb_device *rkusb_connect_path(const char *path);
+rkusb_device *rkusb_connect_device(void);
+rkusb_device *rkusb_reconnect(const char *path, int timeout);
+void rkusb_disconnect(rkusb_device *device);
+
+typedef int (*rkusb_arrival)(void *ctx, const char *path);
+int rkusb_watch(uint16_t mode, rkusb_arrival arrived, void *ctx);
+
+long rkusb_file_size(FILE *fp);
+uint32_t rkusb_vendor_code_size(uint32_t bin_size);
+uint32_t rkusb_prepare_vendor_code(uint8_t *buf, const uint8_t *bin, uint32_t bin_size);
+int rkusb_send_vendor_code(rkusb_device *device, const uint8_t *buf, int size, int code);
+void rkusb_print_stats(rkusb_device *device, FILE *fp, const char *prefix, int json);
+
+#endif /* !_RKUSB_H_ */